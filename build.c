@@ -27,32 +27,78 @@
  * detected within the build.c file.
  *****************************************************************************/
 
+#define _GNU_SOURCE
+#include <stdbool.h>
 #include <stdlib.h>
 
-static const int MAX_CPU_CORES = 8;
+typedef enum TargetKind {
+    TARGET_EXECUTABLE,
+    TARGET_STATIC, // Static archive created with ar
+    TARGET_SHARED, // Shared object linked from position independent objects
+} TargetKind;
+typedef struct Target {
+    const char *name;        // Output file in the mode directory such as "libcore.a", NULL ends the list
+    TargetKind kind;         // Executable, static archive or shared object
+    const char *const *src;  // List of the sources compiled into the target, or glob patterns
+    const char *const *link; // Names of the targets in this list the target links against
+} Target;
 typedef struct Compilers {
     const char *c;
     const char *cpp;
 } Compilers;
+typedef struct Pch {
+    const char *const *c;   // Headers precompiled once for every C source, <name> for system headers, NULL disables
+    const char *const *cpp; // Headers precompiled once for every C++ source, <name> for system headers, NULL disables
+} Pch;
+typedef struct Unity {
+    unsigned int files;         // Average number of sources per batch in unity builds
+    unsigned long max_bytes;    // Source bytes that close a batch early, 0 for no limit
+    const char *const *exclude; // Glob patterns of sources compiled on their own in unity builds
+} Unity;
+typedef struct Cache {
+    const char *dir;        // Directory compiled objects are cached in, NULL disables the cache
+    unsigned long max_size; // Size limit of the cache directory in megabytes
+} Cache;
 struct Config {
     const Compilers cc;          // Compiler to use for building target and build.c
     const char *exe;             // Target executable name
     const char *dir;             // The output directory that the target executable will end up
-    const char *const *src;      // List of all the .c files to be compiled
+    const char *const *src;      // List of all the .c files to be compiled, or glob patterns such as ./src/**/*.c
+    const char *const *exclude;  // Glob patterns of files left out of src
     const char *const *flags;    // List of all the flags that will be sent to the compiler
     const char *const *incs;     // List of libraries to link against
     const char *const *lib_incs; // List of libraries to link against
     const char *const *libs;     // List of libraries to link against
+    const char *const *link;     // Names of the targets from targets linked into exe
+    const Target *targets;       // Libraries and further executables built in the same pool as exe
+    const bool thin_archives;    // Static libraries reference their objects instead of holding copies
+    const char *const *linkers;  // Linkers tried in order for -fuse-ld=, the compiler's default is used when none is found
+    const bool split_dwarf;      // Debug info of the objects goes to .dwo files and the linker writes a gdb index
+    const Cache cache;           // Local cache of compiled objects shared between builds
+    const Pch pch;               // Headers precompiled before the sources of each language
+    const Unity unity;           // Batching of the sources into generated files by the unity option
+    const char *const *workers;  // Addresses of compile workers, unix:PATH or HOST:PORT
 } c_config = {
     .cc = (Compilers){ .c = "gcc", .cpp = "g++" },
     .exe = "example_app",
     .dir = "./out",
+    .cache = (Cache){ .dir = NULL, .max_size = 1024 },
+    .pch = (Pch){ .c = NULL, .cpp = NULL },
+    .unity = (Unity){ .files = 8, .max_bytes = 0, .exclude = NULL },
+    .thin_archives = false,
+#ifdef DEBUG
+    .split_dwarf = true,
+#endif
 
     .src = (const char *[]) {
         "./src/main.c",
         NULL, // Sentinel to mark the end of the array
     },
 
+    .exclude = (const char *[]) {
+        NULL, // Sentinel to mark the end of the array
+    },
+
     .flags = (const char *[]) {
         "-MD",
         "-Wall",
@@ -76,6 +122,24 @@ struct Config {
     .libs = (const char *[]) {
         NULL, // Sentinel to mark the end of the array
     },
+
+    .link = (const char *[]) {
+        NULL, // Sentinel to mark the end of the array
+    },
+
+    .targets = (const Target[]) {
+        { .name = NULL }, // Sentinel to mark the end of the array
+    },
+
+    .linkers = (const char *[]) {
+        "mold",
+        "lld",
+        NULL, // Sentinel to mark the end of the array
+    },
+
+    .workers = (const char *[]) {
+        NULL, // Sentinel to mark the end of the array
+    },
 };
 typedef struct Config config_t;
 
@@ -91,25 +155,48 @@ typedef struct Build build_t;
  *****************************************************************************/
 #include <stdio.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <linux/limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <dirent.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdatomic.h>
 
-static int g_thread_count = 0;
-static pthread_mutex_t g_thread_count_mutex;
+extern char **environ;
+
+#ifndef BUILD_SELF_KEY
+#define BUILD_SELF_KEY 0 // Key of build.c and the mode this executable was built for, 0 when built by hand
+#endif
+
 static pthread_mutex_t g_thread_print_mutex;
+static bool g_progress_shown = false; // Set while a progress line waits to be overwritten, guarded by g_thread_print_mutex
 typedef enum BuildMode {
     MODE_NONE,
     MODE_DEV,
@@ -118,20 +205,36 @@ typedef enum BuildMode {
 
 struct LockFile {
     bool lock;           // Indicates if the build is locked
-    bool rebuilding;     // Indicates if the build file has been modified
     long last_build;     // Timestamp of the last build
-    BuildMode last_mode; // Last build mode used
-} lockfile = { false, 0, MODE_NONE };
+} lockfile = { false, 0 };
 
 typedef struct InternalConfig {
     bool run;         // Indicates if the build should run after building
     bool clean;       // Indicates if the build directory should be cleaned before building
     bool build_only;  // Indicates if only the build file should be built without running it
-    int thread_count; // Indicates if the build should be done in a threaded manner
+    bool stats;       // Indicates if timings of the build phases should be printed
+    bool trace;       // Indicates if a Chrome trace of the build should be written
+    bool watch;       // Indicates if the target should be rebuilt whenever an input changes
+    bool daemon;      // Indicates if the build should be handed to the background build server
+    bool unity;       // Indicates if the sources should be compiled in generated batches
+    int thread_count; // Number of worker threads used to compile source files (0 disables threading)
+    double max_load;  // Jobs only start while the system load is below this, 0 disables the limit
+    long mem_budget_mb; // Memory the running compiles may use together in megabytes, 0 uses MemAvailable
     int run_argc;     // Number of arguments to pass to the build file when running it
     BuildMode mode;   // Build mode to use (none, development, or release)
+    char out_dir[PATH_MAX]; // Output directory of the build mode inside the config dir
+    const char *worker; // Address to compile for other builds on, set by worker ADDR
 } InternalConfig;
-static bool is_using_cpp = false;
+
+const char *mode_dir_name(BuildMode mode)
+{ // {{{
+    // Every build mode keeps its objects and build database in its own tree
+    switch (mode) {
+        case MODE_DEV: return "dbg";
+        case MODE_REL: return "rel";
+        default: return "default";
+    }
+} // }}}
 
 void print_help() {
     printf("\n"
@@ -142,7 +245,7 @@ void print_help() {
 "██████╔╝╚██████╔╝██║███████╗██████╔╝██╗╚██████╗\n"
 "╚═════╝  ╚═════╝ ╚═╝╚══════╝╚═════╝ ╚═╝ ╚═════╝\n"
 "version %s\n\n"
-"Usage: ./build [dbg|rel|clean|build-only|j [NUM]|version|help] -- [ARGS]...\n"
+"Usage: ./build [dbg|rel|clean|no-threading|build-only|stats|trace|watch|daemon|unity|j [NUM]|l [NUM]|mem [MB]|worker ADDR|version|help] -- [ARGS]...\n"
 "Builds C/C++ target applications using the configuration provided in the\n"
 "build.c file. The build executable will rebuild itself when changes are\n"
 "detected within the build.c file.\n\n"
@@ -151,7 +254,24 @@ void print_help() {
 "    rel            Build the target executable with -DRELEASE enabled\n"
 "    clean          Removes the output directory\n"
 "    build-only     Only builds the build executable not the target executable\n"
+"    no-threading   Compiles the source files one at a time on the main thread\n"
+"    stats          Prints the time spent in each build phase\n"
+"    trace          Writes a Chrome trace of the build to trace.json in the\n"
+"                   output directory, open it in Perfetto or chrome://tracing\n"
+"    watch          Rebuilds whenever a source, one of its headers or build.c\n"
+"                   is saved and restarts the executable given after --\n"
+"    daemon         Hands the build to a background server that keeps the build\n"
+"                   state in memory, the server is started when needed\n"
+"    unity          Compiles the sources of each language and directory in\n"
+"                   generated batches that include several of them\n"
 "    j [NUM]        Sets the number of threads to use for building source files\n"
+"                   (defaults to the number of online CPU cores)\n"
+"    l [NUM]        Only starts a compile while the system load is below NUM\n"
+"    mem [MB]       Only starts a compile while the memory it used last time\n"
+"                   fits the budget (defaults to MemAvailable)\n"
+"    worker ADDR    Compiles for the builds listing ADDR in workers[] until\n"
+"                   killed, ADDR is unix:PATH or HOST:PORT, :PORT only\n"
+"                   listens on loopback, 0.0.0.0:PORT on every interface\n"
 "    version        Displays the version of the build.c\n"
 "    help           Displays this text\n"
 "    --             Runs the executable and all args after the double dashes\n"
@@ -160,414 +280,4341 @@ void print_help() {
 "    ./build dev -- --file=./output/\n", build.ver);
 }
 
-static inline void print(const char *section, const char *color, const char *fmt, ...)
+static inline void print_section(const char *section, const char *color)
 { // {{{
-    va_list va;
-    va_start(va, fmt);
-    pthread_mutex_lock(&g_thread_print_mutex);
+    // Clears a progress line left on the terminal, g_thread_print_mutex must be held
+    if (g_progress_shown) {
+        printf("\r\033[K");
+        g_progress_shown = false;
+    }
     if (isatty(1) == 1) {
         printf("[\033[%sm%s\033[0m] ", color, section);
     } else {
         printf("[%s] ", section);
     }
+} // }}}
+static inline void print(const char *section, const char *color, const char *fmt, ...)
+{ // {{{
+    va_list va;
+    va_start(va, fmt);
+    pthread_mutex_lock(&g_thread_print_mutex);
+    print_section(section, color);
     vprintf(fmt, va);
     pthread_mutex_unlock(&g_thread_print_mutex);
     va_end(va);
 } // }}}
+static inline void print_progress_end()
+{ // {{{
+    // Keeps the last progress line on the terminal
+    pthread_mutex_lock(&g_thread_print_mutex);
+    if (g_progress_shown) {
+        printf("\n");
+        fflush(stdout);
+        g_progress_shown = false;
+    }
+    pthread_mutex_unlock(&g_thread_print_mutex);
+} // }}}
 
-// Utility functions
-int exec(const char *format, ...)
+// Arena functions
+typedef struct ArenaBlock {
+    struct ArenaBlock *next; // Previously filled block
+    size_t used;             // Bytes handed out from data
+    size_t size;             // Bytes available in data
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *head; // Block allocations are currently served from
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size)
 { // {{{
-    char cmd[PATH_MAX];
-    va_list val;
-    va_start(val, format);
-    vsprintf(cmd, format, val);
-    va_end(val);
-    print("LOAD", "34", "%s\n", cmd);
-    fflush(stdout);
-    int status = system(cmd);
-    print("DONE", "32", "%s\n", cmd);
-    fflush(stdout);
-    return WEXITSTATUS(status);
+    // Allocations live until the whole arena is freed
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = size > 64 * 1024 ? size : 64 * 1024;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Error: Failed to allocate an arena block\n");
+            return NULL;
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
 } // }}}
-int recursive_mkdir(const char *dir)
+char *arena_strdup(Arena *arena, const char *str)
 { // {{{
-    char tmp[PATH_MAX];
-    snprintf(tmp, sizeof(tmp), "%s", dir);
-    for (char *p = tmp + 1; *p; p++) if (*p == '/') { *p = 0; mkdir(tmp, S_IRWXU); *p = '/'; }
-    return mkdir(tmp, S_IRWXU);
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy != NULL) memcpy(copy, str, len);
+    return copy;
 } // }}}
-void append_strings(char *cmd, const char *const *flags)
+void arena_free(Arena *arena)
 { // {{{
-    for (int i = 0;; i++) {
-        if (flags[i] == NULL) break; // Sentinel check for end of array
-        snprintf(cmd + strlen(cmd), PATH_MAX - strlen(cmd), "%s ", flags[i]);
+    while (arena->head != NULL) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
 } // }}}
-void strip_extension(const char *src, char *dst, size_t dst_size)
+
+// Command functions
+typedef struct Cmd {
+    char **argv;           // NULL terminated argument vector passed to the process
+    unsigned int count;    // Number of arguments, not counting the terminating NULL
+    unsigned int capacity; // Number of argument slots allocated
+    Arena *arena;          // Holds the arguments when set, otherwise each one is allocated on its own
+} Cmd;
+
+bool cmd_append(Cmd *cmd, const char *arg)
 { // {{{
-    snprintf(dst, dst_size, "%s", src);
-    char *dot = strrchr(dst, '.');
-    if (dot) *dot = '\0';
+    if (cmd->count + 2 > cmd->capacity) {
+        unsigned int capacity = cmd->capacity ? cmd->capacity * 2 : 16;
+        char **argv = realloc(cmd->argv, capacity * sizeof(char *));
+        if (argv == NULL) {
+            fprintf(stderr, "Error: Failed to grow the command arguments\n");
+            return false;
+        }
+        cmd->argv = argv;
+        cmd->capacity = capacity;
+    }
+    cmd->argv[cmd->count] = cmd->arena != NULL ? arena_strdup(cmd->arena, arg) : strdup(arg);
+    if (cmd->argv[cmd->count] == NULL) {
+        fprintf(stderr, "Error: Failed to copy command argument '%s'\n", arg);
+        return false;
+    }
+    cmd->argv[++cmd->count] = NULL;
+    return true;
 } // }}}
-unsigned int get_array_length(const char *const *array)
+bool cmd_append_fmt(Cmd *cmd, const char *format, ...)
 { // {{{
-    unsigned int length = 0;
-    while (array[length] != NULL) {
-        length++;
+    va_list val, again;
+    va_start(val, format);
+    va_copy(again, val);
+    int len = vsnprintf(NULL, 0, format, val);
+    va_end(val);
+    char *arg = len >= 0 ? malloc(len + 1) : NULL;
+    if (arg == NULL) {
+        va_end(again);
+        fprintf(stderr, "Error: Failed to format a command argument\n");
+        return false;
     }
-    return length;
+    vsnprintf(arg, len + 1, format, again);
+    va_end(again);
+    bool ok = cmd_append(cmd, arg);
+    free(arg);
+    return ok;
 } // }}}
-
-// Dependency functions
-__time_t get_file_modified_time(const char *file_path)
+void append_strings(Cmd *cmd, const char *const *flags)
 { // {{{
-    struct stat file_stat;
-    if (stat(file_path, &file_stat) == -1) {
-        perror("stat");
-        return -1;
+    for (int i = 0;; i++) {
+        if (flags[i] == NULL) break; // Sentinel check for end of array
+        cmd_append(cmd, flags[i]);
     }
-    return file_stat.st_mtime;
 } // }}}
-__time_t last_dependencies_modified(const char *file_path)
+void cmd_free(Cmd *cmd)
 { // {{{
-    FILE *fp = fopen(file_path, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Error: Failed to open file %s for reading\n", file_path);
-        return -1;
+    for (unsigned int i = 0; i < cmd->count && cmd->arena == NULL; i++) {
+        free(cmd->argv[i]);
     }
-    __time_t last_modified = 0;
-
-    char* line = NULL;
-    size_t line_len = 0;
-    while (getline(&line, &line_len, fp) != -1) {
-        char *tok = strtok(line, " ");
-        while (tok != NULL) {
-            size_t len = strlen(tok);
-            if (tok[len - 1] == '\n') tok[--len] = '\0';
-            if (access(tok, F_OK) == 0) {
-                struct stat file_stat;
-                if (stat(tok, &file_stat) == -1) {
-                    fprintf(stderr, "Error: Failed to stat file %s\n", tok);
-                    continue;
-                }
-                if (file_stat.st_mtime > last_modified) {
-                    last_modified = file_stat.st_mtime;
-                }
-            }
-            tok = strtok(NULL, " ");
-        }
+    free(cmd->argv);
+    memset(cmd, 0, sizeof(*cmd));
+} // }}}
+char *cmd_render(const Cmd *cmd)
+{ // {{{
+    // Joins the arguments into a single line for display, quoting arguments with spaces
+    size_t size = 1;
+    for (unsigned int i = 0; i < cmd->count; i++) {
+        size += strlen(cmd->argv[i]) + 3;
     }
-
-    fclose(fp);
-    return last_modified;
+    char *line = malloc(size);
+    if (line == NULL) return NULL;
+    char *p = line;
+    for (unsigned int i = 0; i < cmd->count; i++) {
+        const char *arg = cmd->argv[i];
+        bool quote = strpbrk(arg, " \t") != NULL;
+        p += sprintf(p, quote ? "%s'%s'" : "%s%s", i > 0 ? " " : "", arg);
+    }
+    *p = '\0';
+    return line;
 } // }}}
-
-bool serialize_lock_file(const char *file_path, const struct LockFile *lock)
+bool cmd_exceeds_arg_max(const Cmd *cmd)
 { // {{{
-    FILE *fp = fopen(file_path, "w+");
-    if (fp == NULL) {
-        fprintf(stderr, "Error: Failed to open lock file %s for writing\n", file_path);
-        return false;
+    // The kernel copies the arguments and the environment into the new
+    // process within ARG_MAX, and no single argument may be longer than
+    // MAX_ARG_STRLEN
+    const size_t max_arg_strlen = 32 * 4096;
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t size = 2048; // Headroom POSIX asks to leave
+    for (char **env = environ; *env != NULL; env++) {
+        size += strlen(*env) + 1 + sizeof(char *);
     }
-    int written = fwrite(lock, sizeof(struct LockFile), 1, fp);
-    if (written <= 0) {
-        fprintf(stderr, "Error: Failed to write lock file %s\n", file_path);
-        fprintf(stderr, "%s\n", strerror(errno));
+    for (unsigned int i = 0; i < cmd->count; i++) {
+        size_t len = strlen(cmd->argv[i]) + 1;
+        if (len > max_arg_strlen) return true;
+        size += len + sizeof(char *);
     }
-    fclose(fp);
-    return written > 0;
+    return size > (size_t)(arg_max > 0 ? arg_max : 128 * 1024);
 } // }}}
-bool deserialize_lock_file(const char *file_path, struct LockFile *lock)
+bool cmd_response_file(const Cmd *cmd, Cmd *short_cmd, char *path, size_t path_size)
 { // {{{
-    FILE *fp = fopen(file_path, "r");
+    // Moves every argument after the program into an @file, escaped the way
+    // gcc, clang, the linkers and ar read them back
+    const char *tmp = getenv("TMPDIR");
+    if (snprintf(path, path_size, "%s/build-XXXXXX.rsp", tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp") >= (int)path_size) {
+        fprintf(stderr, "Error: Path of the response file is too long\n");
+        return false;
+    }
+    int fd = mkstemps(path, 4);
+    FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
     if (fp == NULL) {
-        // TODO: Ignore filed to open lock file when no output directory is available
-        // fprintf(stderr, "Error: Failed to open lock file %s for reading\n", file_path);
-        // fprintf(stderr, "%s\n", strerror(errno));
+        fprintf(stderr, "Error: Failed to create a response file for %s: %s\n", cmd->argv[0], strerror(errno));
+        if (fd != -1) close(fd);
         return false;
     }
-    int read = fread(lock, sizeof(struct LockFile), 1, fp);
-    if (read <= 0) {
-        fprintf(stderr, "Error: Failed to read lock file %s\n", file_path);
-        fprintf(stderr, "%s\n", strerror(errno));
+    for (unsigned int i = 1; i < cmd->count; i++) {
+        const char *arg = cmd->argv[i];
+        if (arg[0] == '\0') fputs("\"\"", fp);
+        for (; *arg != '\0'; arg++) {
+            if (isspace((unsigned char)*arg) || *arg == '\'' || *arg == '"' || *arg == '\\') fputc('\\', fp);
+            fputc(*arg, fp);
+        }
+        fputc('\n', fp);
     }
-    fclose(fp);
-    return read > 0;
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && cmd_append(short_cmd, cmd->argv[0]) && cmd_append_fmt(short_cmd, "@%s", path);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to write the response file %s\n", path);
+        unlink(path);
+    }
+    return ok;
 } // }}}
 
-// Path manipulation functions
-void get_path_without_filename(const char *src, char *dst, size_t dst_size)
+// Output capture functions
+typedef struct JobOutput {
+    char *data;      // Everything the processes of a job wrote to stdout and stderr
+    size_t size;     // Number of bytes captured
+    size_t capacity; // Number of bytes allocated
+    int fd;          // Read end of the pipe of the running process, -1 once it reached the end
+} JobOutput;
+
+struct OutputMux {
+    pthread_once_t once;   // Starts the poll loop on first use
+    bool running;          // Set when the poll loop is running
+    pthread_mutex_t mutex; // Guards the list of open pipes
+    pthread_cond_t cond;   // Signalled when a pipe reaches the end of its output
+    int wake[2];           // Pipe that wakes the poll loop when a pipe is added
+    JobOutput **outputs;   // Outputs with an open pipe
+    unsigned int count;    // Number of open pipes
+    unsigned int capacity; // Number of slots allocated
+} g_output_mux = { .once = PTHREAD_ONCE_INIT, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Set by a worker while it runs a job, processes it spawns write into the job's output
+static __thread JobOutput *t_job_output = NULL;
+
+bool job_output_append(JobOutput *output, const char *data, size_t len)
 { // {{{
-    snprintf(dst, dst_size, "%s", src);
-    char *slash = strrchr(dst, '/');
-    if (slash) {
-        *slash = '\0';
-    } else {
-        dst[0] = '\0';
+    if (output->size + len > output->capacity) {
+        size_t capacity = output->capacity ? output->capacity : 4096;
+        while (capacity < output->size + len) capacity *= 2;
+        char *grown = realloc(output->data, capacity);
+        if (grown == NULL) return false; // Dropped, the exit status still tells what happened
+        output->data = grown;
+        output->capacity = capacity;
     }
+    memcpy(output->data + output->size, data, len);
+    output->size += len;
+    return true;
 } // }}}
-void get_filename_without_path(const char *src, char *dst, size_t dst_size)
+void output_mux_read(struct OutputMux *mux, JobOutput *output)
 { // {{{
-    const char *slash = strrchr(src, '/');
-    if (slash) {
-        snprintf(dst, dst_size, "%s", slash + 1);
-    } else {
-        snprintf(dst, dst_size, "%s", src);
+    // Only the poll loop touches the buffer while the pipe is open
+    char buffer[65536];
+    ssize_t len = read(output->fd, buffer, sizeof(buffer));
+    if (len == -1 && (errno == EINTR || errno == EAGAIN)) return;
+    if (len > 0) {
+        job_output_append(output, buffer, len);
+        return;
     }
-    dst[dst_size - 1] = '\0';
-} // }}}
-
-// Build functions
-void *build_file(const void *arg)
-{ // {{{
-    const char *cmd = (const char *)arg;
-    fflush(stdout);
-    int status = exec("%s", cmd);
-    if (status != 0) {
-        fprintf(stderr, "Error: build_file failed with status %d\n", status);
+    pthread_mutex_lock(&mux->mutex);
+    for (unsigned int i = 0; i < mux->count; i++) {
+        if (mux->outputs[i] == output) {
+            mux->outputs[i] = mux->outputs[--mux->count];
+            break;
+        }
     }
-    pthread_mutex_lock(&g_thread_count_mutex);
-    g_thread_count = g_thread_count - 1;
-    pthread_mutex_unlock(&g_thread_count_mutex);
-    return NULL;
+    close(output->fd);
+    output->fd = -1;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
 } // }}}
-int make_targets(const config_t *config, char* build_file_cmd[], unsigned int size)
+void *output_mux_loop(void *arg)
 { // {{{
-    for (unsigned int i = 0; i < size; i++) {
-        if (build_file_cmd[i] == NULL) {
-            fprintf(stderr, "Error: build_file_cmd[%u] is NULL\n", i);
-            return -1;
+    // A single thread polls the pipes of every running process so workers
+    // never block on output and no process stalls on a full pipe
+    struct OutputMux *mux = arg;
+    struct pollfd *fds = NULL;
+    JobOutput **polled = NULL;
+    unsigned int capacity = 0;
+    for (;;) {
+        pthread_mutex_lock(&mux->mutex);
+        unsigned int count = mux->count;
+        if (count + 1 > capacity) {
+            unsigned int new_capacity = (count + 1) * 2;
+            struct pollfd *new_fds = realloc(fds, new_capacity * sizeof(struct pollfd));
+            if (new_fds != NULL) fds = new_fds;
+            JobOutput **new_polled = realloc(polled, new_capacity * sizeof(JobOutput *));
+            if (new_polled != NULL) polled = new_polled;
+            if (new_fds != NULL && new_polled != NULL) capacity = new_capacity;
         }
-
-        char* const cmd = build_file_cmd[i];
-        char dir[PATH_MAX], filename[PATH_MAX];
-
-        // Strip the extension and get the directory and filename
-        strip_extension(config->src[i], filename, PATH_MAX);
-        get_filename_without_path(filename, filename, sizeof(filename));
-        get_path_without_filename(config->src[i], dir, sizeof(dir));
-
-        // Create the output directory if it doesn't exist
-        char full_dir[PATH_MAX];
-        snprintf(full_dir, PATH_MAX - strlen(full_dir) - 2, "%s/%s", config->dir, dir);
-        recursive_mkdir(full_dir);
-
-        // Check if the source file has been modified since the last build
-        const __time_t last_modified = get_file_modified_time(config->src[i]);
-
-        // Check the .d file for dependencies
-        char dep_file[PATH_MAX];
-        snprintf(dep_file, PATH_MAX - strlen(dep_file) - 2, "%s/%s.d", full_dir, filename);
-        if (access(dep_file, F_OK) == 0) {
-            // If the .d file exists, check its dependencies
-            __time_t deps_last_modified  = last_dependencies_modified(dep_file);
-
-            // If the dependencies and source file have not changed since the last build,
-            // skip building this file
-            if (deps_last_modified < lockfile.last_build && last_modified < lockfile.last_build) {
-                build_file_cmd[i][0] = '\0';
-                continue;
-            }
+        if (count + 1 > capacity) count = capacity > 0 ? capacity - 1 : 0;
+        for (unsigned int i = 0; i < count; i++) {
+            polled[i] = mux->outputs[i];
+            fds[i + 1] = (struct pollfd){ .fd = polled[i]->fd, .events = POLLIN };
+        }
+        pthread_mutex_unlock(&mux->mutex);
+        if (capacity == 0) {
+            sleep(1); // Out of memory, try again later
+            continue;
         }
 
-        // Create the command to compile the source file
-        const char *extension = strrchr(config->src[i], '.');
-        if (extension != NULL) {
-            if (strstr(extension, "cpp") == NULL) {
-                snprintf(cmd, PATH_MAX - strlen(cmd), "%s -c %s -o %s/%s.o ",
-                        config->cc.c, config->src[i], full_dir, filename);
-            } else {
-                is_using_cpp = true;
-                snprintf(cmd, PATH_MAX - strlen(cmd), "%s -c %s -o %s/%s.o ",
-                        config->cc.cpp, config->src[i], full_dir, filename);
-            }
-        } else {
-            snprintf(cmd, PATH_MAX - strlen(cmd), "%s -c %s -o %s/%s.o ",
-                    config->cc.c, config->src[i], full_dir, filename);
+        fds[0] = (struct pollfd){ .fd = mux->wake[0], .events = POLLIN };
+        if (poll(fds, count + 1, -1) == -1) continue;
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(mux->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            if (fds[i + 1].revents != 0) output_mux_read(mux, polled[i]);
         }
-        append_strings(cmd, config->flags);
-        append_strings(cmd, config->incs);
     }
-    return 0;
+    return NULL;
 } // }}}
-int make_executable(const config_t *config, char* build_exe_cmd)
+void output_mux_start()
 { // {{{
-    if (config->exe == NULL) {
-        fprintf(stderr, "Error: config->exe is NULL\n");
-        return -1;
+    struct OutputMux *mux = &g_output_mux;
+    if (pipe2(mux->wake, O_CLOEXEC | O_NONBLOCK) == -1) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, output_mux_loop, mux) != 0) {
+        close(mux->wake[0]);
+        close(mux->wake[1]);
+        return;
     }
-    char* const cmd = build_exe_cmd;
-    snprintf(cmd, PATH_MAX, "%s -o %s/%s ", is_using_cpp ? config->cc.cpp : config->cc.c, config->dir, config->exe);
-    for (unsigned int i = 0; i < get_array_length(config->src); i++) {
-        if (config->src[i] == NULL) {
-            fprintf(stderr, "Error: config->src[%u] is NULL\n", i);
+    pthread_detach(thread);
+    mux->running = true;
+} // }}}
+int output_capture(JobOutput *output)
+{ // {{{
+    // Returns the write end of a pipe that the poll loop appends to the
+    // output of the job, -1 when the output can't be captured
+    struct OutputMux *mux = &g_output_mux;
+    pthread_once(&mux->once, output_mux_start);
+    int fds[2];
+    if (!mux->running || pipe2(fds, O_CLOEXEC) == -1) return -1;
+    pthread_mutex_lock(&mux->mutex);
+    if (mux->count == mux->capacity) {
+        unsigned int capacity = mux->capacity ? mux->capacity * 2 : 16;
+        JobOutput **outputs = realloc(mux->outputs, capacity * sizeof(JobOutput *));
+        if (outputs == NULL) {
+            pthread_mutex_unlock(&mux->mutex);
+            close(fds[0]);
+            close(fds[1]);
             return -1;
         }
-        char filename[PATH_MAX];
-        strip_extension(config->src[i], filename, sizeof(filename));
-        snprintf(cmd + strlen(cmd), PATH_MAX - strlen(cmd), "%s/%s.o ", config->dir, filename);
+        mux->outputs = outputs;
+        mux->capacity = capacity;
     }
-    append_strings(cmd, config->flags);
-    append_strings(cmd, config->incs);
-    append_strings(cmd, config->lib_incs);
-    append_strings(cmd, config->libs);
-    return 0;
+    output->fd = fds[0];
+    mux->outputs[mux->count++] = output;
+    pthread_mutex_unlock(&mux->mutex);
+    if (write(mux->wake[1], "", 1) == -1) {} // A full pipe already wakes the loop
+    return fds[1];
 } // }}}
-int make_build(const BuildMode mode, char* cmd)
+void output_wait(JobOutput *output)
 { // {{{
-    if (build.cc == NULL || build.file == NULL || build.exe == NULL) {
-        fprintf(stderr, "Error: Build configuration is incomplete\n");
-        return -1;
-    }
-    snprintf(cmd, PATH_MAX, "%s -o %s %s ", build.cc, build.exe, build.file);
-    switch (mode) {
-        case MODE_REL:
-            append_strings(cmd, (const char *[]){"-O2", "-lpthread", NULL});
-            break;
-        case MODE_DEV:
-            append_strings(cmd, (const char *[]){"-Wall", "-DDEBUG", "-g", "-lpthread", NULL});
-            break;
-        case MODE_NONE:
-            append_strings(cmd, (const char *[]){"-Wall", "-lpthread", NULL});
-            break;
-        default:
-            fprintf(stderr, "Error: Invalid build mode\n");
-            return -1;
+    // Blocks until everything the process wrote has been read
+    struct OutputMux *mux = &g_output_mux;
+    pthread_mutex_lock(&mux->mutex);
+    while (output->fd != -1) {
+        pthread_cond_wait(&mux->cond, &mux->mutex);
     }
-    return 0;
+    pthread_mutex_unlock(&mux->mutex);
 } // }}}
 
-// Compile function
-int compile_build_file(const char *lock_file_path, int argc, char const *const argv[], const InternalConfig *conf)
+// Utility functions
+double now_ms()
 { // {{{
-    __time_t build_file_last_modified = get_file_modified_time(build.file);
-
-    // If the build file has been modified, rebuild it
-    if (build_file_last_modified >= lockfile.last_build
-            || lockfile.last_mode != conf->mode) {
-
-        if (lockfile.rebuilding) {
-            return 0; // Already rebuilding, no need to rebuild again
-        }
-
-        // Rebuild the build file
-        char build_file_cmd[PATH_MAX];
-        if (make_build(conf->mode, build_file_cmd) != 0) {
-            fprintf(stderr, "Error: make_build failed\n");
-            return -1;
-        }
-
-        if (exec("%s", build_file_cmd) != 0) {
-            fprintf(stderr, "Error: Failed to build the build file\n");
-            return -1;
-        }
-
-        if (lockfile.last_mode != conf->mode) {
-            lockfile.last_build = 0; // Reset last build time if the mode has changed
-        } else {
-            lockfile.last_build = time(NULL);
-        }
-        lockfile.lock = false;
-        lockfile.last_mode = conf->mode;
-        lockfile.rebuilding = true; // Mark the build file as dirty since it has been rebuilt
-        serialize_lock_file(lock_file_path, &lockfile);
-
-        char cmd[PATH_MAX];
-        snprintf(cmd, PATH_MAX, "%s", build.exe);
-        for (int i = 1; i < argc; i++) {
-            strcat(cmd, " ");
-            strcat(cmd, argv[i]);
-        }
-        if (exec("%s", cmd) != 0) {
-            fprintf(stderr, "Error: Failed to run the build file\n");
-            return -1;
-        }
-        exit(0); // Exit after running the build file
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+} // }}}
+bool spawn_process(const Cmd *cmd, const posix_spawn_file_actions_t *actions, pid_t *pid)
+{ // {{{
+    // Spawn the process directly rather than through /bin/sh so arguments are
+    // passed through untouched and concurrent calls from workers are safe
+    int err = posix_spawnp(pid, cmd->argv[0], actions, NULL, cmd->argv, environ);
+    if (err != 0) {
+        fprintf(stderr, "Error: Failed to run %s: %s\n", cmd->argv[0], strerror(err));
+        return false;
     }
-
-    return 0; // No need to rebuild the build file
+    return true;
 } // }}}
-int compile_files(const config_t *config, const InternalConfig *internal_config)
+int spawn_and_wait(const Cmd *cmd, const posix_spawn_file_actions_t *actions, struct rusage *usage)
 { // {{{
-    (void)config; // Mark as intentionally unused
-    // Allocate memory for build commands
-    unsigned int size = get_array_length(c_config.src);
-    char* file_cmd[size];
-    pthread_t build_file_threads[size];
-    for (unsigned int i = 0; i < size; i++) {
-        file_cmd[i] = malloc(PATH_MAX);
+    // Processes run for a job write into a pipe captured with the job instead
+    // of to the terminal, unless the caller redirects them itself
+    JobOutput *output = actions == NULL ? t_job_output : NULL;
+    posix_spawn_file_actions_t capture_actions;
+    int capture_fd = output != NULL ? output_capture(output) : -1;
+    if (capture_fd != -1) {
+        posix_spawn_file_actions_init(&capture_actions);
+        posix_spawn_file_actions_adddup2(&capture_actions, capture_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&capture_actions, capture_fd, STDERR_FILENO);
+        actions = &capture_actions;
     }
-
-    // Create the build commands for each source file
-    if (make_targets(&c_config, file_cmd, size) != 0) {
-        fprintf(stderr, "Error: make_build_targets failed\n");
-        return -1;
+    pid_t pid;
+    bool spawned = spawn_process(cmd, actions, &pid);
+    if (capture_fd != -1) {
+        posix_spawn_file_actions_destroy(&capture_actions);
+        close(capture_fd);
     }
-
-    // Run the build commands for each source file
-    int files_built = 0;
-    for (unsigned int i = 0; i < size; i++) {
-        if (internal_config->thread_count > 0) {
-            if (file_cmd[i][0] == '\0') {
-                continue;
-            }
-            while (true) {
-                pthread_mutex_lock(&g_thread_count_mutex);
-                if (g_thread_count < MAX_CPU_CORES) {
-                    pthread_mutex_unlock(&g_thread_count_mutex);
-                    break;
-                }
-                pthread_mutex_unlock(&g_thread_count_mutex);
-                usleep(100);
-            }
-            pthread_mutex_lock(&g_thread_count_mutex);
-            g_thread_count = g_thread_count + 1;
-            pthread_mutex_unlock(&g_thread_count_mutex);
-            if (pthread_create(&build_file_threads[i], NULL, (void *(*)(void *))build_file, file_cmd[i]) != 0) {
-                fprintf(stderr, "Error: pthread_create failed\n");
-                return -1;
-            }
-            files_built++;
-        } else {
-            if (file_cmd[i][0] == '\0') {
-                continue;
-            }
-            build_file(file_cmd[i]);
-            files_built++;
+    int wstatus = 0;
+    struct rusage ignored;
+    while (spawned && wait4(pid, &wstatus, 0, usage != NULL ? usage : &ignored) == -1) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Error: wait4 failed for %s: %s\n", cmd->argv[0], strerror(errno));
+            spawned = false;
         }
     }
-
-    // Wait for all threads to finish if multithreaded
-    for (unsigned int i = 0; i < size; i++) {
-        if (internal_config->thread_count > 0) {
-            if (file_cmd[i][0] == '\0') {
-                continue;
-            }
-            pthread_join(build_file_threads[i], NULL);
-        }
-        free(file_cmd[i]);
+    if (capture_fd != -1) output_wait(output);
+    if (!spawned) return 127;
+    if (WIFEXITED(wstatus)) return WEXITSTATUS(wstatus);
+    if (WIFSIGNALED(wstatus)) return 128 + WTERMSIG(wstatus);
+    return 127;
+} // }}}
+int exec_rusage(const Cmd *cmd, struct rusage *usage)
+{ // {{{
+    if (cmd->count == 0) {
+        fprintf(stderr, "Error: Cannot run an empty command\n");
+        return -1;
     }
+    if (t_job_output != NULL) {
+        return spawn_and_wait(cmd, NULL, usage); // Reported with the job once it finishes
+    }
+    char *line = cmd_render(cmd);
+    print("LOAD", "34", "%s\n", line ? line : cmd->argv[0]);
+    fflush(stdout);
 
-
-    return files_built;
+    int status = spawn_and_wait(cmd, NULL, usage);
+    print("DONE", "32", "%s\n", line ? line : cmd->argv[0]);
+    fflush(stdout);
+    free(line);
+    return status;
 } // }}}
-bool compile_exe(const config_t *config)
+int exec(const Cmd *cmd)
 { // {{{
-    char build_exe_cmd[PATH_MAX];
-    if (make_executable(config, build_exe_cmd) != 0) {
-        fprintf(stderr, "Error: make_build_executable failed\n");
-        return false;
+    return exec_rusage(cmd, NULL);
+} // }}}
+bool write_all(int fd, const void *data, size_t size)
+{ // {{{
+    const char *p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        p += written;
+        size -= written;
     }
-    if (exec("%s", build_exe_cmd) != 0) {
-        fprintf(stderr, "Error: Failed to run the build command\n");
-        return false;
+    return true;
+} // }}}
+bool send_all(int fd, const void *data, size_t size)
+{ // {{{
+    // Like write_all for sockets, a peer that went away fails the call
+    // instead of raising SIGPIPE
+    const char *p = data;
+    while (size > 0) {
+        ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        p += sent;
+        size -= sent;
     }
     return true;
 } // }}}
-
-// Parse command line arguments
-bool parse_args(struct InternalConfig *conf, int argc, const char *const argv[])
+bool read_all(int fd, void *data, size_t size)
+{ // {{{
+    char *p = data;
+    while (size > 0) {
+        ssize_t got = read(fd, p, size);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        p += got;
+        size -= got;
+    }
+    return true;
+} // }}}
+bool write_if_changed(const char *path, const char *content, size_t size)
+{ // {{{
+    // Leaves a file with the same content untouched so its modification time
+    // doesn't trigger a rebuild
+    bool same = false;
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        char *existing = malloc(size + 1);
+        same = existing != NULL && fread(existing, 1, size + 1, fp) == size && memcmp(existing, content, size) == 0;
+        free(existing);
+        fclose(fp);
+    }
+    bool ok = same;
+    if (!same && (fp = fopen(path, "w")) != NULL) {
+        ok = fwrite(content, 1, size, fp) == size;
+        ok = fclose(fp) == 0 && ok;
+    }
+    if (!ok) fprintf(stderr, "Error: Failed to write %s\n", path);
+    return ok;
+} // }}}
+int recursive_mkdir(const char *dir)
+{ // {{{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", dir);
+    for (char *p = tmp + 1; *p; p++) if (*p == '/') { *p = 0; mkdir(tmp, S_IRWXU); *p = '/'; }
+    return mkdir(tmp, S_IRWXU);
+} // }}}
+bool program_on_path(const char *name)
+{ // {{{
+    const char *path = getenv("PATH");
+    while (path != NULL && *path != '\0') {
+        const char *end = strchr(path, ':');
+        size_t len = end != NULL ? (size_t)(end - path) : strlen(path);
+        char file[PATH_MAX];
+        if (len > 0 && snprintf(file, sizeof(file), "%.*s/%s", (int)len, path, name) < (int)sizeof(file)
+                && access(file, X_OK) == 0) {
+            return true;
+        }
+        path = end != NULL ? end + 1 : NULL;
+    }
+    return false;
+} // }}}
+void strip_extension(const char *src, char *dst, size_t dst_size)
+{ // {{{
+    snprintf(dst, dst_size, "%s", src);
+    char *dot = strrchr(dst, '.');
+    if (dot) *dot = '\0';
+} // }}}
+unsigned int get_array_length(const char *const *array)
+{ // {{{
+    unsigned int length = 0;
+    while (array[length] != NULL) {
+        length++;
+    }
+    return length;
+} // }}}
+
+// Trace functions
+typedef enum TraceCategory {
+    TRACE_PHASE,   // Serial step of the build run on the main thread
+    TRACE_COMPILE, // Process compiling a single source file
+    TRACE_LINK     // Process linking the executable
+} TraceCategory;
+
+typedef struct TraceEvent {
+    char *name;            // Name shown on the slice
+    TraceCategory cat;     // Kind of work the event covers
+    double start_ms;       // Monotonic start time
+    double end_ms;         // Monotonic end time
+    int tid;               // Worker slot the event ran on, 0 for the main thread
+    bool process;          // Set when the event ran a process and has the fields below
+    int exit_code;         // Exit status of the process
+    struct rusage usage;   // Resources used by the process
+} TraceEvent;
+
+struct Trace {
+    bool enabled;          // Set by the trace option
+    char path[PATH_MAX];   // File the events are appended to on exit
+    TraceEvent *events;    // Recorded events, only touched by the main thread
+    unsigned int count;    // Number of recorded events
+    unsigned int capacity; // Number of event slots allocated
+} g_trace = {0};
+
+static const char *const TRACE_CATEGORY_NAMES[] = { "phase", "compile", "link" };
+static const char *const TRACE_ENV = "BUILD_TRACE_APPEND";
+
+void trace_record(TraceCategory cat, const char *name, double start_ms, double end_ms,
+        int tid, bool process, int exit_code, const struct rusage *usage)
+{ // {{{
+    if (!g_trace.enabled) return;
+    if (g_trace.count == g_trace.capacity) {
+        unsigned int capacity = g_trace.capacity ? g_trace.capacity * 2 : 256;
+        TraceEvent *events = realloc(g_trace.events, capacity * sizeof(TraceEvent));
+        if (events == NULL) return;
+        g_trace.events = events;
+        g_trace.capacity = capacity;
+    }
+    TraceEvent *event = &g_trace.events[g_trace.count];
+    memset(event, 0, sizeof(*event));
+    event->name = strdup(name);
+    if (event->name == NULL) return;
+    event->cat = cat;
+    event->start_ms = start_ms;
+    event->end_ms = end_ms;
+    event->tid = tid;
+    event->process = process;
+    event->exit_code = exit_code;
+    if (usage != NULL) event->usage = *usage;
+    g_trace.count++;
+} // }}}
+void trace_phase(const char *name, double start_ms)
+{ // {{{
+    trace_record(TRACE_PHASE, name, start_ms, now_ms(), 0, false, 0, NULL);
+} // }}}
+void trace_process(TraceCategory cat, const char *name, double start_ms, double end_ms,
+        int slot, int exit_code, const struct rusage *usage)
+{ // {{{
+    // Workers are shown one row below the main thread
+    trace_record(cat, name, start_ms, end_ms, slot + 1, true, exit_code, usage);
+} // }}}
+void trace_write_string(FILE *fp, const char *str)
+{ // {{{
+    fputc('"', fp);
+    for (const char *p = str; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(fp, "\\%c", *p);
+        else if ((unsigned char)*p < 0x20) fprintf(fp, "\\u%04x", *p);
+        else fputc(*p, fp);
+    }
+    fputc('"', fp);
+} // }}}
+void trace_flush()
+{ // {{{
+    // Appends to a JSON array that is deliberately left open, the trace
+    // viewers accept that and it lets a re-run build add its own events
+    if (!g_trace.enabled || g_trace.count == 0) return;
+    FILE *fp = fopen(g_trace.path, "a");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Failed to open trace file %s\n", g_trace.path);
+        return;
+    }
+    const int pid = getpid();
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"build %d\"}},\n", pid, pid);
+    int max_tid = 0;
+    for (unsigned int i = 0; i < g_trace.count; i++) {
+        const TraceEvent *event = &g_trace.events[i];
+        if (event->tid > max_tid) max_tid = event->tid;
+        fprintf(fp, "{\"name\":");
+        trace_write_string(fp, event->name);
+        fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d",
+                TRACE_CATEGORY_NAMES[event->cat], event->start_ms * 1000.0,
+                (event->end_ms - event->start_ms) * 1000.0, pid, event->tid);
+        if (event->process) {
+            const struct rusage *usage = &event->usage;
+            fprintf(fp, ",\"args\":{\"exit_code\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld}",
+                    event->exit_code, event->end_ms - event->start_ms,
+                    usage->ru_utime.tv_sec * 1000.0 + usage->ru_utime.tv_usec / 1000.0,
+                    usage->ru_stime.tv_sec * 1000.0 + usage->ru_stime.tv_usec / 1000.0,
+                    usage->ru_maxrss);
+        }
+        fprintf(fp, "},\n");
+        free(event->name);
+    }
+    fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"main\"}},\n", pid);
+    for (int tid = 1; tid <= max_tid; tid++) {
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}},\n",
+                pid, tid, tid - 1);
+    }
+    fclose(fp);
+    free(g_trace.events);
+    g_trace.events = NULL;
+    g_trace.count = g_trace.capacity = 0;
+} // }}}
+void trace_discard()
+{ // {{{
+    for (unsigned int i = 0; i < g_trace.count; i++) free(g_trace.events[i].name);
+    g_trace.count = 0;
+} // }}}
+bool trace_init(const char *dir)
+{ // {{{
+    // The first build process starts a fresh file, the rebuilt build
+    // executable it re-runs is handed the environment variable and appends
+    // to it instead. Nothing else it runs sees the variable
+    if (snprintf(g_trace.path, sizeof(g_trace.path), "%s/trace.json", dir) >= (int)sizeof(g_trace.path)) {
+        fprintf(stderr, "Error: Trace path in %s is too long\n", dir);
+        return false;
+    }
+    if (getenv(TRACE_ENV) == NULL) {
+        FILE *fp = fopen(g_trace.path, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Error: Failed to open trace file %s\n", g_trace.path);
+            return false;
+        }
+        fprintf(fp, "[\n");
+        fclose(fp);
+    }
+    unsetenv(TRACE_ENV);
+    static bool registered = false;
+    if (!registered) atexit(trace_flush);
+    registered = true;
+    g_trace.enabled = true;
+    return true;
+} // }}}
+
+// Hash functions
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t xxh64_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline uint32_t xxh64_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{ // {{{
+    acc += input * XXH_PRIME64_2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+} // }}}
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{ // {{{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+} // }}}
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{ // {{{
+    // XXH64, used to fingerprint file contents and commands
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *const end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        const uint8_t *const limit = end - 32;
+        do {
+            v1 = xxh64_round(v1, xxh64_read64(p)); p += 8;
+            v2 = xxh64_round(v2, xxh64_read64(p)); p += 8;
+            v3 = xxh64_round(v3, xxh64_read64(p)); p += 8;
+            v4 = xxh64_round(v4, xxh64_read64(p)); p += 8;
+        } while (p <= limit);
+        h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) + xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+        h = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+} // }}}
+uint64_t hash_combine(uint64_t seed, uint64_t value)
+{ // {{{
+    return hash_bytes(&value, sizeof(value), seed);
+} // }}}
+uint64_t hash_string(const char *str, uint64_t seed)
+{ // {{{
+    return hash_bytes(str, strlen(str), seed);
+} // }}}
+uint64_t hash_cmd(const Cmd *cmd)
+{ // {{{
+    // Hash every argument including its terminator so "-a b" and "-ab" differ
+    uint64_t h = 0;
+    for (unsigned int i = 0; i < cmd->count; i++) {
+        h = hash_bytes(cmd->argv[i], strlen(cmd->argv[i]) + 1, h);
+    }
+    return h;
+} // }}}
+bool hash_file(const char *file_path, uint64_t seed, uint64_t *hash)
+{ // {{{
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return false;
+    }
+    if (file_stat.st_size == 0) {
+        *hash = hash_bytes("", 0, seed);
+        close(fd);
+        return true;
+    }
+    void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    *hash = hash_bytes(data, file_stat.st_size, seed);
+    munmap(data, file_stat.st_size);
+    return true;
+} // }}}
+
+// Stat cache functions
+typedef struct StatEntry {
+    const char *path;   // Interned path, NULL for an empty slot
+    uint64_t path_hash; // Hash of the path
+    bool valid;         // Cleared when the file is known to have changed
+    bool exists;        // Set when stat succeeded
+    int64_t mtime_sec;  // Modification time seconds
+    int64_t mtime_nsec; // Modification time nanoseconds
+    int64_t size;       // Size of the file in bytes
+} StatEntry;
+
+struct StatCache {
+    Arena paths;              // Interned path strings
+    StatEntry *entries;       // Open addressing table of entries
+    unsigned int count;       // Number of occupied entries
+    unsigned int capacity;    // Number of entries allocated, always a power of two
+    pthread_mutex_t mutex;    // Guards the table, stat() itself runs unlocked
+    atomic_ulong hits;        // Lookups answered from the table
+    atomic_ulong misses;      // Lookups that had to call stat()
+} g_stat_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+StatEntry *stat_cache_slot(struct StatCache *cache, const char *path, uint64_t path_hash)
+{ // {{{
+    // Returns the entry for the path or the empty slot it belongs in, the mutex must be held
+    unsigned int slot = path_hash & (cache->capacity - 1);
+    while (cache->entries[slot].path != NULL) {
+        StatEntry *entry = &cache->entries[slot];
+        if (entry->path_hash == path_hash && strcmp(entry->path, path) == 0) return entry;
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    return &cache->entries[slot];
+} // }}}
+bool stat_cache_grow(struct StatCache *cache)
+{ // {{{
+    unsigned int capacity = cache->capacity ? cache->capacity * 2 : 4096;
+    StatEntry *entries = calloc(capacity, sizeof(StatEntry));
+    if (entries == NULL) {
+        fprintf(stderr, "Error: Failed to grow the stat cache\n");
+        return false;
+    }
+    StatEntry *old_entries = cache->entries;
+    unsigned int old_capacity = cache->capacity;
+    cache->entries = entries;
+    cache->capacity = capacity;
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old_entries[i].path == NULL) continue;
+        *stat_cache_slot(cache, old_entries[i].path, old_entries[i].path_hash) = old_entries[i];
+    }
+    free(old_entries);
+    return true;
+} // }}}
+bool stat_cache_get(const char *path, StatEntry *out)
+{ // {{{
+    // Stats each unique path at most once per invocation, returns false when
+    // the file does not exist
+    struct StatCache *cache = &g_stat_cache;
+    uint64_t path_hash = hash_string(path, 0);
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->capacity != 0) {
+        StatEntry *entry = stat_cache_slot(cache, path, path_hash);
+        if (entry->path != NULL && entry->valid) {
+            *out = *entry;
+            pthread_mutex_unlock(&cache->mutex);
+            atomic_fetch_add(&cache->hits, 1);
+            return out->exists;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    atomic_fetch_add(&cache->misses, 1);
+
+    struct stat file_stat;
+    StatEntry result = { .path_hash = path_hash, .valid = true };
+    if (stat(path, &file_stat) == 0) {
+        result.exists = true;
+        result.mtime_sec = file_stat.st_mtim.tv_sec;
+        result.mtime_nsec = file_stat.st_mtim.tv_nsec;
+        result.size = file_stat.st_size;
+    } else {
+        result.size = -1;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    if ((cache->count + 1) * 2 > cache->capacity && !stat_cache_grow(cache)) {
+        pthread_mutex_unlock(&cache->mutex);
+        *out = result;
+        return result.exists;
+    }
+    StatEntry *entry = stat_cache_slot(cache, path, path_hash);
+    if (entry->path == NULL) {
+        result.path = arena_strdup(&cache->paths, path);
+        if (result.path != NULL) {
+            *entry = result;
+            cache->count++;
+        }
+    } else {
+        result.path = entry->path;
+        *entry = result;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    *out = result;
+    return result.exists;
+} // }}}
+void stat_cache_invalidate(const char *path)
+{ // {{{
+    // Called after a job writes a file so the next lookup stats it again
+    struct StatCache *cache = &g_stat_cache;
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->capacity != 0) {
+        StatEntry *entry = stat_cache_slot(cache, path, hash_string(path, 0));
+        if (entry->path != NULL) entry->valid = false;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+} // }}}
+
+void stat_cache_clear()
+{ // {{{
+    // Forgets every stat, used when the files may have changed behind our back
+    struct StatCache *cache = &g_stat_cache;
+    pthread_mutex_lock(&cache->mutex);
+    for (unsigned int i = 0; i < cache->capacity; i++) {
+        cache->entries[i].valid = false;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+} // }}}
+
+// Dependency functions
+typedef struct PathList {
+    char **paths;          // Paths read from a dependency file
+    unsigned int count;    // Number of paths in the list
+    unsigned int capacity; // Number of path slots allocated
+} PathList;
+
+void path_list_free(PathList *list)
+{ // {{{
+    for (unsigned int i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+} // }}}
+bool path_list_append(PathList *list, const char *path, size_t len)
+{ // {{{
+    // One slot is kept free so the list stays NULL terminated like src[]
+    if (list->count + 1 >= list->capacity) {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 32;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            fprintf(stderr, "Error: Failed to grow the dependency list\n");
+            return false;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strndup(path, len);
+    if (list->paths[list->count] == NULL) return false;
+    list->paths[++list->count] = NULL;
+    return true;
+} // }}}
+bool parse_dependencies(const char *file_path, PathList *deps)
+{ // {{{
+    // Reads the prerequisites of a make style .d file written by -MD
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    char token[PATH_MAX];
+    size_t len = 0;
+    int c;
+    bool ok = true;
+    while (ok) {
+        c = fgetc(fp);
+        if (c == '\\') {
+            int next = fgetc(fp);
+            if (next == ' ' || next == '#' || next == '\\') {
+                c = next; // Escaped character that is part of the path
+            } else {
+                if (next != EOF) ungetc(next, fp);
+                if (next == '\n' || next == '\r') continue; // Line continuation
+            }
+        } else if (c == EOF || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            // Skip the rule target which ends with a colon
+            if (len > 0 && token[len - 1] != ':') {
+                ok = path_list_append(deps, token, len);
+            }
+            len = 0;
+            if (c == EOF) break;
+            continue;
+        }
+        if (len + 1 < sizeof(token)) {
+            token[len++] = (char)c;
+        }
+    }
+
+    fclose(fp);
+    return ok;
+} // }}}
+
+bool serialize_lock_file(const char *file_path, const struct LockFile *lock)
+{ // {{{
+    FILE *fp = fopen(file_path, "w+");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Failed to open lock file %s for writing\n", file_path);
+        return false;
+    }
+    int written = fwrite(lock, sizeof(struct LockFile), 1, fp);
+    if (written <= 0) {
+        fprintf(stderr, "Error: Failed to write lock file %s\n", file_path);
+        fprintf(stderr, "%s\n", strerror(errno));
+    }
+    fclose(fp);
+    return written > 0;
+} // }}}
+bool deserialize_lock_file(const char *file_path, struct LockFile *lock)
+{ // {{{
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        // TODO: Ignore filed to open lock file when no output directory is available
+        // fprintf(stderr, "Error: Failed to open lock file %s for reading\n", file_path);
+        // fprintf(stderr, "%s\n", strerror(errno));
+        return false;
+    }
+    int read = fread(lock, sizeof(struct LockFile), 1, fp);
+    if (read <= 0) {
+        fprintf(stderr, "Error: Failed to read lock file %s\n", file_path);
+        fprintf(stderr, "%s\n", strerror(errno));
+    }
+    fclose(fp);
+    return read > 0;
+} // }}}
+
+void release_lock_file(const char *file_path, bool built)
+{ // {{{
+    // Unlocks, the build time only moves forward when the build succeeded
+    if (built) lockfile.last_build = time(NULL);
+    lockfile.lock = false;
+    serialize_lock_file(file_path, &lockfile);
+} // }}}
+
+// Build database functions
+static const char BUILD_DB_MAGIC[8] = "BDCDB05";
+
+typedef struct FileRecord {
+    const char *path;    // Path of the file as written in the config or .d file, directories end in a slash
+    uint64_t path_hash;  // Hash of the path used by the index
+    int64_t mtime_sec;   // Modification time seconds when the file was last hashed
+    int64_t mtime_nsec;  // Modification time nanoseconds when the file was last hashed
+    int64_t size;        // Size of the file in bytes when it was last hashed, -1 when missing
+    uint64_t hash;       // Content hash of the file or hash of a directory listing, 0 when the file is missing
+    uint64_t input_hash; // Fingerprint of the inputs that produced this file, 0 when unknown
+    uint64_t cmd_hash;   // Hash of the exact command that produced this file, 0 when unknown
+    uint32_t duration_ms; // Wall time of the last successful command that produced this file, 0 when unknown
+    uint32_t peak_rss_kb; // Peak memory of the last successful command that produced this file in KiB, 0 when unknown
+    uint32_t *deps;      // Ids of the files this output was built from, the source first, or the entries of a directory
+    uint32_t dep_count;  // Number of ids in deps
+    uint32_t mark;       // Scratch generation used to deduplicate dependencies
+    bool used;           // Set when the record is still needed and should be saved
+} FileRecord;
+
+// On disk the database is a header followed by fixed size file entries, the
+// dependency edges as file ids and a string table of NUL terminated paths so
+// it can be mapped and used without parsing
+typedef struct BuildDbHeader {
+    char magic[8];
+    uint32_t file_count;  // Number of BuildDbEntry records
+    uint32_t edge_count;  // Number of uint32_t dependency ids
+    uint32_t string_size; // Size of the string table in bytes
+    uint32_t reserved;
+} BuildDbHeader;
+
+typedef struct BuildDbEntry {
+    uint64_t path_hash;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint64_t hash;
+    uint64_t input_hash;
+    uint64_t cmd_hash;
+    uint32_t path_offset; // Offset of the path in the string table
+    uint32_t dep_first;   // Index of the first dependency id in the edge table
+    uint32_t dep_count;   // Number of dependency ids
+    uint32_t duration_ms; // Wall time of the last successful command that produced the file
+    uint32_t peak_rss_kb; // Peak memory of the last successful command that produced the file in KiB
+    uint32_t reserved;
+} BuildDbEntry;
+
+struct BuildDb {
+    Arena paths;                // Paths of records that were not loaded from the file
+    FileRecord *files;          // All known files, addressed by id
+    unsigned int file_count;    // Number of files in the database
+    unsigned int file_capacity; // Number of file slots allocated
+    unsigned int *slots;        // Open addressing index of path hash to file id + 1
+    unsigned int slot_capacity; // Number of slots in the index, always a power of two
+    uint32_t mark;              // Current generation for FileRecord.mark
+    unsigned int loaded_count;  // Number of records in the database file
+    bool modified;              // Set when the database differs from the file it was loaded from
+    const char *map;            // Mapping of the database file loaded at startup
+    size_t map_size;            // Size of the mapping in bytes
+} build_db = {0};
+
+static inline bool build_db_is_mapped(const struct BuildDb *db, const void *ptr)
+{ // {{{
+    return db->map != NULL && (const char *)ptr >= db->map && (const char *)ptr < db->map + db->map_size;
+} // }}}
+bool build_db_grow_slots(struct BuildDb *db, unsigned int min_capacity)
+{ // {{{
+    unsigned int capacity = db->slot_capacity ? db->slot_capacity * 2 : 1024;
+    while (capacity < min_capacity) capacity *= 2;
+    unsigned int *slots = calloc(capacity, sizeof(unsigned int));
+    if (slots == NULL) {
+        fprintf(stderr, "Error: Failed to grow the build database index\n");
+        return false;
+    }
+    for (unsigned int i = 0; i < db->file_count; i++) {
+        unsigned int slot = db->files[i].path_hash & (capacity - 1);
+        while (slots[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        slots[slot] = i + 1;
+    }
+    free(db->slots);
+    db->slots = slots;
+    db->slot_capacity = capacity;
+    return true;
+} // }}}
+bool build_db_reserve(struct BuildDb *db, unsigned int count)
+{ // {{{
+    if (count > db->file_capacity) {
+        unsigned int capacity = db->file_capacity ? db->file_capacity : 256;
+        while (capacity < count) capacity *= 2;
+        FileRecord *files = realloc(db->files, capacity * sizeof(FileRecord));
+        if (files == NULL) {
+            fprintf(stderr, "Error: Failed to grow the build database\n");
+            return false;
+        }
+        db->files = files;
+        db->file_capacity = capacity;
+    }
+    // Keep the index at most half full so probe sequences stay short
+    if (count * 2 > db->slot_capacity) {
+        return build_db_grow_slots(db, count * 2);
+    }
+    return true;
+} // }}}
+FileRecord *build_db_insert(struct BuildDb *db, const char *path, uint64_t path_hash)
+{ // {{{
+    // The caller has made sure the path is not in the database yet
+    if (!build_db_reserve(db, db->file_count + 1)) return NULL;
+    unsigned int slot = path_hash & (db->slot_capacity - 1);
+    while (db->slots[slot] != 0) slot = (slot + 1) & (db->slot_capacity - 1);
+    FileRecord *record = &db->files[db->file_count];
+    memset(record, 0, sizeof(*record));
+    record->path = path;
+    record->path_hash = path_hash;
+    record->size = -1;
+    db->slots[slot] = ++db->file_count;
+    return record;
+} // }}}
+FileRecord *build_db_find(struct BuildDb *db, const char *path, bool create)
+{ // {{{
+    // Records may move when the database grows, so hold on to ids rather than
+    // pointers across calls that can create records
+    uint64_t path_hash = hash_string(path, 0);
+    if (db->slot_capacity != 0) {
+        unsigned int slot = path_hash & (db->slot_capacity - 1);
+        while (db->slots[slot] != 0) {
+            FileRecord *record = &db->files[db->slots[slot] - 1];
+            if (record->path_hash == path_hash && strcmp(record->path, path) == 0) return record;
+            slot = (slot + 1) & (db->slot_capacity - 1);
+        }
+    }
+    if (!create) return NULL;
+    char *copy = arena_strdup(&db->paths, path);
+    if (copy == NULL) return NULL;
+    FileRecord *record = build_db_insert(db, copy, path_hash);
+    db->modified = true;
+    return record;
+} // }}}
+void build_db_free(struct BuildDb *db)
+{ // {{{
+    for (unsigned int i = 0; i < db->file_count; i++) {
+        if (!build_db_is_mapped(db, db->files[i].deps)) free(db->files[i].deps);
+    }
+    if (db->map != NULL) munmap((void *)db->map, db->map_size);
+    arena_free(&db->paths);
+    free(db->files);
+    free(db->slots);
+    memset(db, 0, sizeof(*db));
+} // }}}
+FileRecord *build_db_check_record(struct BuildDb *db, uint32_t id)
+{ // {{{
+    // Only rehashes the file when its modification time or size differ from
+    // the last time it was hashed, the stat itself comes from the stat cache
+    FileRecord *record = &db->files[id];
+    record->used = true;
+
+    StatEntry file_stat;
+    if (!stat_cache_get(record->path, &file_stat)) {
+        if (record->size != -1 || record->hash != 0) db->modified = true;
+        record->mtime_sec = record->mtime_nsec = 0;
+        record->size = -1;
+        record->hash = 0;
+        return record;
+    }
+    if (record->hash != 0
+            && record->mtime_sec == file_stat.mtime_sec
+            && record->mtime_nsec == file_stat.mtime_nsec
+            && record->size == file_stat.size) {
+        return record;
+    }
+    db->modified = true;
+    record->mtime_sec = file_stat.mtime_sec;
+    record->mtime_nsec = file_stat.mtime_nsec;
+    record->size = file_stat.size;
+    if (!hash_file(record->path, 0, &record->hash)) {
+        record->hash = 0;
+    }
+    return record;
+} // }}}
+bool build_db_set_deps(struct BuildDb *db, uint32_t id, const char *src, const PathList *deps)
+{ // {{{
+    // Replaces the inputs of an output with the source followed by the
+    // deduplicated headers read from its freshly written .d file
+    uint32_t *ids = malloc((deps->count + 1) * sizeof(uint32_t));
+    if (ids == NULL) {
+        fprintf(stderr, "Error: Failed to allocate dependencies for %s\n", src);
+        return false;
+    }
+    uint32_t count = 0;
+    db->mark++;
+    for (unsigned int i = 0; i <= deps->count; i++) {
+        FileRecord *dep = build_db_find(db, i == 0 ? src : deps->paths[i - 1], true);
+        if (dep == NULL) {
+            free(ids);
+            return false;
+        }
+        if (dep->mark == db->mark) continue;
+        dep->mark = db->mark;
+        ids[count++] = dep - db->files;
+    }
+    FileRecord *record = &db->files[id];
+    if (!build_db_is_mapped(db, record->deps)) free(record->deps);
+    record->deps = ids;
+    record->dep_count = count;
+    db->modified = true;
+    return true;
+} // }}}
+uint64_t fingerprint_inputs(struct BuildDb *db, uint32_t id)
+{ // {{{
+    // Combines the path and content of every input, a missing input hashes
+    // to 0 so its removal also changes the fingerprint
+    uint64_t h = 0;
+    for (uint32_t i = 0; i < db->files[id].dep_count; i++) {
+        const FileRecord *dep = build_db_check_record(db, db->files[id].deps[i]);
+        h = hash_combine(h, dep->path_hash);
+        h = hash_combine(h, dep->hash);
+    }
+    return h != 0 ? h : 1;
+} // }}}
+bool serialize_build_db(const char *file_path, struct BuildDb *db)
+{ // {{{
+    // Only records used during this invocation and everything they reference
+    // are kept so stale entries are dropped, ids are renumbered to match.
+    // Directories list other directories, so the marking follows every level
+    uint32_t *pending = malloc((db->file_count + 1) * sizeof(uint32_t));
+    if (pending == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the build database ids\n");
+        return false;
+    }
+    unsigned int pending_count = 0;
+    for (unsigned int i = 0; i < db->file_count; i++) {
+        if (db->files[i].used) pending[pending_count++] = i;
+    }
+    while (pending_count > 0) {
+        const FileRecord *record = &db->files[pending[--pending_count]];
+        for (uint32_t d = 0; d < record->dep_count; d++) {
+            FileRecord *dep = &db->files[record->deps[d]];
+            if (dep->used) continue;
+            dep->used = true;
+            pending[pending_count++] = record->deps[d];
+        }
+    }
+    free(pending);
+    unsigned int used_count = 0;
+    for (unsigned int i = 0; i < db->file_count; i++) {
+        if (db->files[i].used) used_count++;
+    }
+    if (!db->modified && used_count == db->loaded_count) {
+        return true; // Nothing changed, leave the file untouched
+    }
+    uint32_t *new_ids = malloc((db->file_count + 1) * sizeof(uint32_t));
+    if (new_ids == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the build database ids\n");
+        return false;
+    }
+    BuildDbHeader header = {0};
+    memcpy(header.magic, BUILD_DB_MAGIC, sizeof(header.magic));
+    for (unsigned int i = 0; i < db->file_count; i++) {
+        const FileRecord *record = &db->files[i];
+        if (!record->used) continue;
+        new_ids[i] = header.file_count++;
+        header.edge_count += record->dep_count;
+        header.string_size += strlen(record->path) + 1;
+    }
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Failed to open build database %s for writing\n", tmp_path);
+        free(new_ids);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint32_t dep_first = 0, path_offset = 0;
+    for (unsigned int i = 0; ok && i < db->file_count; i++) {
+        const FileRecord *record = &db->files[i];
+        if (!record->used) continue;
+        BuildDbEntry entry = {
+            .path_hash = record->path_hash,
+            .mtime_sec = record->mtime_sec,
+            .mtime_nsec = record->mtime_nsec,
+            .size = record->size,
+            .hash = record->hash,
+            .input_hash = record->input_hash,
+            .cmd_hash = record->cmd_hash,
+            .path_offset = path_offset,
+            .dep_first = dep_first,
+            .dep_count = record->dep_count,
+            .duration_ms = record->duration_ms,
+            .peak_rss_kb = record->peak_rss_kb,
+        };
+        ok = fwrite(&entry, sizeof(entry), 1, fp) == 1;
+        dep_first += record->dep_count;
+        path_offset += strlen(record->path) + 1;
+    }
+    for (unsigned int i = 0; ok && i < db->file_count; i++) {
+        const FileRecord *record = &db->files[i];
+        if (!record->used) continue;
+        for (uint32_t d = 0; ok && d < record->dep_count; d++) {
+            ok = fwrite(&new_ids[record->deps[d]], sizeof(uint32_t), 1, fp) == 1;
+        }
+    }
+    for (unsigned int i = 0; ok && i < db->file_count; i++) {
+        const FileRecord *record = &db->files[i];
+        if (!record->used) continue;
+        size_t len = strlen(record->path) + 1;
+        ok = fwrite(record->path, 1, len, fp) == len;
+    }
+    free(new_ids);
+    if (fclose(fp) != 0) ok = false;
+    if (!ok || rename(tmp_path, file_path) != 0) {
+        fprintf(stderr, "Error: Failed to write build database %s\n", file_path);
+        fprintf(stderr, "%s\n", strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+    db->modified = false; // The file matches memory until the next change
+    db->loaded_count = header.file_count;
+    return true;
+} // }}}
+bool deserialize_build_db(const char *file_path, struct BuildDb *db)
+{ // {{{
+    // Maps the database and points paths and dependency lists straight into
+    // the mapping, only the mutable fields are copied
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size < (off_t)sizeof(BuildDbHeader)) {
+        close(fd);
+        return false;
+    }
+    const size_t map_size = file_stat.st_size;
+    const char *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const BuildDbHeader *header = (const BuildDbHeader *)map;
+    const size_t entries_size = (size_t)header->file_count * sizeof(BuildDbEntry);
+    const size_t edges_size = (size_t)header->edge_count * sizeof(uint32_t);
+    bool ok = memcmp(header->magic, BUILD_DB_MAGIC, sizeof(header->magic)) == 0
+        && sizeof(*header) + entries_size + edges_size + header->string_size == map_size
+        && (header->string_size == 0 || map[map_size - 1] == '\0');
+    if (!ok) {
+        // A corrupt or outdated database only costs a full rebuild
+        fprintf(stderr, "Error: Ignoring unreadable build database %s\n", file_path);
+        munmap((void *)map, map_size);
+        return false;
+    }
+    db->map = map;
+    db->map_size = map_size;
+
+    const BuildDbEntry *entries = (const BuildDbEntry *)(map + sizeof(*header));
+    const uint32_t *edges = (const uint32_t *)(map + sizeof(*header) + entries_size);
+    const char *strings = map + sizeof(*header) + entries_size + edges_size;
+    ok = build_db_reserve(db, header->file_count);
+    for (uint32_t i = 0; ok && i < header->file_count; i++) {
+        const BuildDbEntry *entry = &entries[i];
+        ok = entry->path_offset < header->string_size
+            && (uint64_t)entry->dep_first + entry->dep_count <= header->edge_count;
+        for (uint32_t d = 0; ok && d < entry->dep_count; d++) {
+            ok = edges[entry->dep_first + d] < header->file_count;
+        }
+        if (!ok) break;
+        FileRecord *record = build_db_insert(db, strings + entry->path_offset, entry->path_hash);
+        record->mtime_sec = entry->mtime_sec;
+        record->mtime_nsec = entry->mtime_nsec;
+        record->size = entry->size;
+        record->hash = entry->hash;
+        record->input_hash = entry->input_hash;
+        record->cmd_hash = entry->cmd_hash;
+        record->duration_ms = entry->duration_ms;
+        record->peak_rss_kb = entry->peak_rss_kb;
+        record->deps = (uint32_t *)(edges + entry->dep_first);
+        record->dep_count = entry->dep_count;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Ignoring unreadable build database %s\n", file_path);
+        build_db_free(db);
+        return false;
+    }
+    db->loaded_count = header->file_count;
+    return true;
+} // }}}
+
+// Path manipulation functions
+void get_path_without_filename(const char *src, char *dst, size_t dst_size)
+{ // {{{
+    snprintf(dst, dst_size, "%s", src);
+    char *slash = strrchr(dst, '/');
+    if (slash) {
+        *slash = '\0';
+    } else {
+        dst[0] = '\0';
+    }
+} // }}}
+void get_filename_without_path(const char *src, char *dst, size_t dst_size)
+{ // {{{
+    const char *slash = strrchr(src, '/');
+    if (slash) {
+        snprintf(dst, dst_size, "%s", slash + 1);
+    } else {
+        snprintf(dst, dst_size, "%s", src);
+    }
+    dst[dst_size - 1] = '\0';
+} // }}}
+
+// Source expansion functions
+static unsigned int g_dirs_listed = 0; // Directories read during this build because their listing changed
+
+static inline bool is_glob_pattern(const char *path)
+{ // {{{
+    return strpbrk(path, "*?[") != NULL;
+} // }}}
+static inline bool is_directory_record(const FileRecord *record)
+{ // {{{
+    const size_t len = strlen(record->path);
+    return len > 0 && record->path[len - 1] == '/';
+} // }}}
+int compare_paths(const void *a, const void *b)
+{ // {{{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+} // }}}
+bool glob_match(const char *pattern, const char *path)
+{ // {{{
+    // Matches one path segment at a time with fnmatch, a ** segment matches
+    // any number of directories
+    if (pattern[0] == '*' && pattern[1] == '*' && (pattern[2] == '/' || pattern[2] == '\0')) {
+        if (pattern[2] == '\0') return true;
+        for (const char *p = path;; p++) {
+            if (glob_match(pattern + 3, p)) return true;
+            p = strchr(p, '/');
+            if (p == NULL) return false;
+        }
+    }
+    const char *pattern_end = strchr(pattern, '/');
+    const char *path_end = strchr(path, '/');
+    if (pattern_end == NULL) return path_end == NULL && fnmatch(pattern, path, FNM_PERIOD) == 0;
+    if (path_end == NULL) return false;
+    char segment[NAME_MAX + 1], name[NAME_MAX + 1];
+    const size_t segment_len = pattern_end - pattern, name_len = path_end - path;
+    if (segment_len > NAME_MAX || name_len > NAME_MAX) return false;
+    memcpy(segment, pattern, segment_len);
+    segment[segment_len] = '\0';
+    memcpy(name, path, name_len);
+    name[name_len] = '\0';
+    return fnmatch(segment, name, FNM_PERIOD) == 0 && glob_match(pattern_end + 1, path_end + 1);
+} // }}}
+bool is_excluded(const char *const *patterns, const char *path)
+{ // {{{
+    // A leading ./ is ignored on both sides so either spelling matches
+    if (patterns == NULL) return false;
+    if (strncmp(path, "./", 2) == 0) path += 2;
+    for (unsigned int i = 0; patterns[i] != NULL; i++) {
+        const char *pattern = patterns[i];
+        if (strncmp(pattern, "./", 2) == 0) pattern += 2;
+        if (glob_match(pattern, path)) return true;
+    }
+    return false;
+} // }}}
+bool scan_directory(const char *dir_path, uint32_t *id)
+{ // {{{
+    // Keeps the listing of a directory in its build database record, the
+    // deps are its files and subdirectories. The listing is reused while the
+    // modification time of the directory matches, which changes whenever an
+    // entry is added, removed or renamed
+    FileRecord *record = build_db_find(&build_db, dir_path, true);
+    if (record == NULL) return false;
+    record->used = true;
+    *id = record - build_db.files;
+    StatEntry dir_stat;
+    const bool exists = stat_cache_get(dir_path, &dir_stat);
+    if (!exists && record->hash == 0 && record->dep_count == 0) return true;
+    if (exists && record->hash != 0
+            && record->mtime_sec == dir_stat.mtime_sec
+            && record->mtime_nsec == dir_stat.mtime_nsec) {
+        return true;
+    }
+
+    // The type comes from the directory entry, only entries whose type it
+    // doesn't give, like symlinks, are stat'ed
+    PathList entries = {0};
+    DIR *dir = exists ? opendir(dir_path) : NULL;
+    bool ok = true;
+    if (dir != NULL) {
+        g_dirs_listed++;
+        struct dirent *entry;
+        while (ok && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue; // Hidden entries, . and .. are never matched
+            bool is_dir = entry->d_type == DT_DIR;
+            bool is_file = entry->d_type == DT_REG;
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                struct stat entry_stat;
+                if (fstatat(dirfd(dir), entry->d_name, &entry_stat, 0) != 0) continue;
+                is_dir = S_ISDIR(entry_stat.st_mode);
+                is_file = S_ISREG(entry_stat.st_mode);
+            }
+            if (!is_dir && !is_file) continue;
+            char path[PATH_MAX];
+            int len = snprintf(path, sizeof(path), "%s%s%s", dir_path, entry->d_name, is_dir ? "/" : "");
+            if (len >= (int)sizeof(path)) {
+                fprintf(stderr, "Error: Path of %s in %s is too long\n", entry->d_name, dir_path);
+                continue;
+            }
+            ok = path_list_append(&entries, path, len);
+        }
+        closedir(dir);
+    }
+    // Sorted so the order of the sources doesn't depend on the file system
+    if (entries.count > 1) qsort(entries.paths, entries.count, sizeof(char *), compare_paths);
+
+    uint32_t *ids = malloc((entries.count + 1) * sizeof(uint32_t));
+    if (!ok || ids == NULL) {
+        fprintf(stderr, "Error: Failed to list %s\n", dir_path);
+        free(ids);
+        path_list_free(&entries);
+        return false;
+    }
+    uint64_t listing = 0;
+    for (unsigned int i = 0; i < entries.count; i++) {
+        FileRecord *child = build_db_find(&build_db, entries.paths[i], true);
+        if (child == NULL) {
+            free(ids);
+            path_list_free(&entries);
+            return false;
+        }
+        ids[i] = child - build_db.files;
+        listing = hash_combine(listing, child->path_hash);
+    }
+    record = &build_db.files[*id];
+    if (!build_db_is_mapped(&build_db, record->deps)) free(record->deps);
+    record->deps = ids;
+    record->dep_count = entries.count;
+    record->mtime_sec = exists ? dir_stat.mtime_sec : 0;
+    record->mtime_nsec = exists ? dir_stat.mtime_nsec : 0;
+    record->size = exists ? dir_stat.size : -1;
+    record->hash = exists ? (listing != 0 ? listing : 1) : 0;
+    build_db.modified = true;
+    path_list_free(&entries);
+    return true;
+} // }}}
+bool add_source(const config_t *config, uint32_t id, PathList *sources)
+{ // {{{
+    // Patterns may overlap, every file is only added once
+    FileRecord *record = &build_db.files[id];
+    if (record->mark == build_db.mark) return true;
+    record->mark = build_db.mark;
+    if (is_excluded(config->exclude, record->path)) return true;
+    return path_list_append(sources, record->path, strlen(record->path));
+} // }}}
+bool expand_directory(const config_t *config, uint32_t dir_id, const char *pattern, PathList *sources)
+{ // {{{
+    // Walks the listings one pattern segment at a time, so only directories
+    // the pattern can reach are listed
+    const char *slash = strchr(pattern, '/');
+    const char *rest = slash != NULL ? slash + 1 : NULL;
+    const size_t segment_len = slash != NULL ? (size_t)(slash - pattern) : strlen(pattern);
+    char segment[NAME_MAX + 1];
+    if (segment_len > NAME_MAX) return true;
+    memcpy(segment, pattern, segment_len);
+    segment[segment_len] = '\0';
+
+    // ** matches this directory, then every subdirectory with the same
+    // pattern, at the end of a pattern it matches every file below
+    const bool any_depth = strcmp(segment, "**") == 0;
+    if (any_depth && !expand_directory(config, dir_id, rest != NULL ? rest : "*", sources)) return false;
+
+    const size_t dir_len = strlen(build_db.files[dir_id].path);
+    for (uint32_t i = 0; i < build_db.files[dir_id].dep_count; i++) {
+        // Records move when scanning adds files, so they are looked up by id
+        const uint32_t child_id = build_db.files[dir_id].deps[i];
+        const char *path = build_db.files[child_id].path;
+        const bool is_dir = is_directory_record(&build_db.files[child_id]);
+        uint32_t sub_id;
+        if (any_depth) {
+            if (is_dir && (!scan_directory(path, &sub_id) || !expand_directory(config, sub_id, pattern, sources))) return false;
+            continue;
+        }
+        if (is_dir != (rest != NULL)) continue;
+        char name[NAME_MAX + 1];
+        const size_t name_len = strlen(path) - dir_len - (is_dir ? 1 : 0);
+        if (name_len > NAME_MAX) continue;
+        memcpy(name, path + dir_len, name_len);
+        name[name_len] = '\0';
+        if (fnmatch(segment, name, FNM_PERIOD) != 0) continue;
+        if (is_dir) {
+            if (!scan_directory(path, &sub_id) || !expand_directory(config, sub_id, rest, sources)) return false;
+        } else if (!add_source(config, child_id, sources)) {
+            return false;
+        }
+    }
+    return true;
+} // }}}
+bool expand_sources(const config_t *config, PathList *sources)
+{ // {{{
+    // Expands the glob patterns in src into the list of sources, entries
+    // without a wildcard are taken as they are
+    build_db.mark++;
+    for (unsigned int i = 0; config->src[i] != NULL; i++) {
+        const char *pattern = config->src[i];
+        if (!is_glob_pattern(pattern)) {
+            FileRecord *record = build_db_find(&build_db, pattern, true);
+            if (record == NULL || !add_source(config, record - build_db.files, sources)) return false;
+            continue;
+        }
+        // The walk starts in the directory before the first wildcard
+        const char *start = strpbrk(pattern, "*?[");
+        while (start > pattern && start[-1] != '/') start--;
+        char root[PATH_MAX];
+        if (start == pattern) {
+            snprintf(root, sizeof(root), "./");
+        } else if ((size_t)(start - pattern) < sizeof(root)) {
+            memcpy(root, pattern, start - pattern);
+            root[start - pattern] = '\0';
+        } else {
+            fprintf(stderr, "Error: Pattern %s is too long\n", pattern);
+            return false;
+        }
+        uint32_t root_id;
+        unsigned int count = sources->count;
+        if (!scan_directory(root, &root_id) || !expand_directory(config, root_id, start, sources)) return false;
+        if (sources->count == count) {
+            print("INF", "1", "Pattern %s matched no source files\n", pattern);
+        }
+    }
+    return true;
+} // }}}
+
+// Unity build functions
+int compare_unity_groups(const char *a, const char *b)
+{ // {{{
+    // Sources of the same language in the same directory share batches
+    const char *ea = strrchr(a, '.'), *eb = strrchr(b, '.');
+    bool ca = ea != NULL && strstr(ea, "cpp") != NULL, cb = eb != NULL && strstr(eb, "cpp") != NULL;
+    if (ca != cb) return ca - cb;
+    const char *sa = strrchr(a, '/'), *sb = strrchr(b, '/');
+    size_t la = sa != NULL ? (size_t)(sa - a) : 0, lb = sb != NULL ? (size_t)(sb - b) : 0;
+    int c = strncmp(a, b, la < lb ? la : lb);
+    if (c != 0 || la == lb) return c;
+    return la < lb ? -1 : 1;
+} // }}}
+int compare_unity_sources(const void *a, const void *b)
+{ // {{{
+    const char *pa = *(const char *const *)a, *pb = *(const char *const *)b;
+    int c = compare_unity_groups(pa, pb);
+    return c != 0 ? c : strcmp(pa, pb);
+} // }}}
+bool unity_write_batch(const char *out_dir, const char *const *members, unsigned int count,
+        bool cpp, PathList *batched)
+{ // {{{
+    // The batch is named after its first member so it keeps its name and
+    // object while its members stay the same
+    char dir[PATH_MAX], path[PATH_MAX];
+    get_path_without_filename(members[0], dir, sizeof(dir));
+    const char *relative = strncmp(dir, "./", 2) == 0 ? dir + 2 : dir;
+    if (snprintf(path, sizeof(path), "%s/unity/%s/unity_%08x.%s", out_dir, relative,
+                (unsigned int)hash_string(members[0], 0), cpp ? "cpp" : "c") >= (int)sizeof(path)) {
+        fprintf(stderr, "Error: Unity batch path for %s is too long\n", members[0]);
+        return false;
+    }
+    char *content = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&content, &size);
+    if (fp == NULL) return false;
+    fprintf(fp, "// Unity batch generated by %s, do not edit\n", build.file);
+    for (unsigned int i = 0; i < count; i++) {
+        char resolved[PATH_MAX];
+        fprintf(fp, "#include \"%s\"\n", realpath(members[i], resolved) != NULL ? resolved : members[i]);
+    }
+    fclose(fp);
+    get_path_without_filename(path, dir, sizeof(dir));
+    recursive_mkdir(dir);
+    bool ok = write_if_changed(path, content, size) && path_list_append(batched, path, strlen(path));
+    free(content);
+    return ok;
+} // }}}
+void unity_remove_stale(const char *dir, const ino_t batches[], unsigned int count)
+{ // {{{
+    // Batches are named after their first member, so a batch whose members
+    // shifted leaves its old file and object behind
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)
+                || lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            unity_remove_stale(path, batches, count);
+            continue;
+        }
+        const char *extension = strrchr(entry->d_name, '.');
+        if (strncmp(entry->d_name, "unity_", 6) != 0 || extension == NULL
+                || (strcmp(extension, ".c") != 0 && strcmp(extension, ".cpp") != 0)) {
+            continue;
+        }
+        bool produced = false;
+        for (unsigned int i = 0; i < count && !produced; i++) produced = batches[i] == st.st_ino;
+        if (produced) continue;
+        static const char *const outputs[] = { "o", "d", "dwo" };
+        char stem[PATH_MAX], output[PATH_MAX];
+        strip_extension(path, stem, sizeof(stem));
+        for (unsigned int i = 0; i < sizeof(outputs) / sizeof(outputs[0]); i++) {
+            if (snprintf(output, sizeof(output), "%s.%s", stem, outputs[i]) < (int)sizeof(output)) unlink(output);
+        }
+        unlink(path);
+    }
+    closedir(d);
+} // }}}
+bool unity_batch_sources(const config_t *config, const char *name, const char *out_dir, const char *const *src, PathList *batched)
+{ // {{{
+    // Batch boundaries fall after the sources whose path hashes to a multiple
+    // of the batch size, so adding or removing a source only regroups its own
+    // batch and an edit recompiles one batch. Excluded sources and batches of
+    // one are compiled as they are
+    const Unity *unity = &config->unity;
+    const unsigned int files = unity->files > 0 ? unity->files : 1;
+    unsigned int count = get_array_length(src), candidates = 0, batches = 0;
+    const char **sorted = malloc((count > 0 ? count : 1) * sizeof(char *));
+    if (sorted == NULL) return false;
+    bool ok = true;
+    for (unsigned int i = 0; i < count && ok; i++) {
+        if (is_excluded(unity->exclude, src[i])) {
+            ok = path_list_append(batched, src[i], strlen(src[i]));
+        } else {
+            sorted[candidates++] = src[i];
+        }
+    }
+    const unsigned int alone = batched->count;
+    qsort(sorted, candidates, sizeof(char *), compare_unity_sources);
+
+    unsigned int start = 0;
+    uint64_t bytes = 0;
+    for (unsigned int i = 0; i < candidates && ok; i++) {
+        StatEntry st;
+        bytes += stat_cache_get(sorted[i], &st) && st.exists ? (uint64_t)st.size : 0;
+        bool full = i + 1 == candidates
+            || compare_unity_groups(sorted[i], sorted[i + 1]) != 0
+            || i + 1 - start >= 2 * files
+            || (unity->max_bytes > 0 && bytes >= unity->max_bytes)
+            || hash_string(sorted[i], 0) % files == 0;
+        if (!full) continue;
+        const char *extension = strrchr(sorted[start], '.');
+        bool cpp = extension != NULL && strstr(extension, "cpp") != NULL;
+        ok = i == start
+            ? path_list_append(batched, sorted[i], strlen(sorted[i]))
+            : unity_write_batch(out_dir, &sorted[start], i + 1 - start, cpp, batched);
+        batches++;
+        start = i + 1;
+        bytes = 0;
+    }
+    free(sorted);
+    if (ok) {
+        print("INF", "1", "Unity: %u sources of %s in %u batches, %u excluded\n", candidates, name, batches, alone);
+        ino_t produced[batched->count > 0 ? batched->count : 1];
+        unsigned int produced_count = 0;
+        for (unsigned int i = alone; i < batched->count; i++) {
+            struct stat st;
+            if (stat(batched->paths[i], &st) == 0) produced[produced_count++] = st.st_ino;
+        }
+        char unity_dir[PATH_MAX];
+        if (snprintf(unity_dir, sizeof(unity_dir), "%s/unity", out_dir) < (int)sizeof(unity_dir)) {
+            unity_remove_stale(unity_dir, produced, produced_count);
+        }
+    }
+    return ok;
+} // }}}
+
+// Source file functions
+typedef struct SourceFile {
+    const char *src; // Source file listed in the config, or the generated header of a PCH
+    char *obj;       // Object file written by the compiler, or the precompiled header
+    char *dep;       // Dependency file written by -MD
+    Cmd cmd;         // Command that compiles the source file
+    uint32_t id;     // Id of the object file in the build database
+    bool dirty;      // Set when the object needs to be rebuilt
+    bool is_pch;     // Set when the source is a generated header that gets precompiled
+    struct SourceFile *pch; // Precompiled header the source is compiled with, NULL when none
+} SourceFile;
+
+void source_files_free(SourceFile sources[], unsigned int size)
+{ // {{{
+    for (unsigned int i = 0; i < size; i++) {
+        if (sources[i].is_pch) free((char *)sources[i].src);
+        free(sources[i].obj);
+        free(sources[i].dep);
+        cmd_free(&sources[i].cmd);
+    }
+    free(sources);
+} // }}}
+
+int build_file(const Cmd *cmd, struct rusage *usage)
+{ // {{{
+    // Failures are reported together with the captured output of the job. A
+    // command too long for the system, such as the link of a few thousand
+    // objects, gets its arguments from a response file instead
+    fflush(stdout);
+    if (!cmd_exceeds_arg_max(cmd)) {
+        return exec_rusage(cmd, usage);
+    }
+    Cmd short_cmd = {0};
+    char path[PATH_MAX];
+    if (!cmd_response_file(cmd, &short_cmd, path, sizeof(path))) {
+        cmd_free(&short_cmd);
+        return -1;
+    }
+    int status = exec_rusage(&short_cmd, usage);
+    unlink(path);
+    cmd_free(&short_cmd);
+    return status;
+} // }}}
+bool is_dependency_flag(const char *arg, bool *takes_value)
+{ // {{{
+    // Flags such as -MD and -MF only affect the .d file and not the object
+    *takes_value = !strcmp(arg, "-MF") || !strcmp(arg, "-MT") || !strcmp(arg, "-MQ");
+    return strncmp(arg, "-M", 2) == 0;
+} // }}}
+
+// Remote compile functions
+static const char REMOTE_MAGIC[8] = "BDCRC01";
+static const int REMOTE_TIMEOUT_SEC = 600;          // A worker that goes quiet for this long is given up on
+static const uint32_t REMOTE_MAX_ARGS = 1024 * 1024; // Largest argument list a worker accepts
+#define REMOTE_MAX_WORKERS 64
+
+typedef struct RemoteRequest {
+    char magic[8];
+    uint32_t args_size;   // Bytes of NUL terminated arguments following the header
+    uint32_t cpp;         // Set when the source is C++
+    uint64_t source_size; // Bytes of preprocessed source following the arguments
+} RemoteRequest;
+
+typedef struct RemoteReply {
+    int32_t status;       // Exit status of the compiler
+    uint32_t peak_rss_kb; // Peak memory of the compiler on the worker
+    uint64_t output_size; // Bytes of compiler output following the header
+    uint64_t object_size; // Bytes of the object following the output, 0 when the compile failed
+} RemoteReply;
+
+struct RemoteWorkers {
+    const char *const *addrs;              // Addresses from the config
+    unsigned int count;                    // Number of workers in use
+    atomic_uint next;                      // Round robin position
+    atomic_bool down[REMOTE_MAX_WORKERS];  // Set for workers that failed during this build
+    atomic_uint remote;                    // Jobs compiled on a worker
+    atomic_uint fallback;                  // Jobs compiled here because their worker failed
+} g_remote;
+
+typedef struct RemoteServer {
+    char dir[PATH_MAX];    // Scratch directory of the sources and objects in flight
+    atomic_uint next_id;   // Names the files of each job
+    unsigned int slots;    // Compiles allowed to run at once
+    unsigned int running;  // Compiles running
+    pthread_mutex_t mutex; // Guards running
+    pthread_cond_t cond;   // Signalled when a compile finishes
+} RemoteServer;
+
+typedef struct RemoteConnection {
+    RemoteServer *server;
+    int fd;
+} RemoteConnection;
+
+int remote_socket(const char *addr, bool serve)
+{ // {{{
+    // Connects to or listens on unix:PATH or HOST:PORT, an empty HOST is the
+    // loopback interface so listening publicly takes an explicit address such
+    // as 0.0.0.0:PORT. Returns -1 on failure
+    if (!strncmp(addr, "unix:", 5)) {
+        struct sockaddr_un un = { .sun_family = AF_UNIX };
+        if (strlen(addr + 5) >= sizeof(un.sun_path)) return -1;
+        strcpy(un.sun_path, addr + 5);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+        if (serve) unlink(un.sun_path);
+        bool ok = serve
+            ? bind(fd, (struct sockaddr *)&un, sizeof(un)) == 0 && listen(fd, 64) == 0
+            : connect(fd, (struct sockaddr *)&un, sizeof(un)) == 0;
+        if (!ok) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256];
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || colon - addr >= (long)sizeof(host)) return -1;
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+    char *name = host;
+    size_t len = strlen(name);
+    if (len >= 2 && name[0] == '[' && name[len - 1] == ']') { // [::1]:PORT
+        name[len - 1] = '\0';
+        name++;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *results;
+    if (getaddrinfo(name[0] != '\0' ? name : NULL, colon + 1, &hints, &results) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = results; ai != NULL && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) continue;
+        int one = 1;
+        if (serve) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        } else {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        bool ok = serve
+            ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0
+            : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    return fd;
+} // }}}
+bool send_file(int sock, const char *path, uint64_t size)
+{ // {{{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    char buffer[65536];
+    while (size > 0) {
+        ssize_t got = read(fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0 || !send_all(sock, buffer, got)) break;
+        size -= got;
+    }
+    close(fd);
+    return size == 0;
+} // }}}
+bool receive_file(int sock, const char *path, uint64_t size)
+{ // {{{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return false;
+    char buffer[65536];
+    while (size > 0) {
+        ssize_t got = read(sock, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0 || !write_all(fd, buffer, got)) break;
+        size -= got;
+    }
+    close(fd);
+    return size == 0;
+} // }}}
+void remote_init(const config_t *config)
+{ // {{{
+    // Every build starts with all workers up again
+    struct RemoteWorkers *remote = &g_remote;
+    remote->addrs = config->workers;
+    remote->count = config->workers != NULL ? get_array_length(config->workers) : 0;
+    if (remote->count > REMOTE_MAX_WORKERS) {
+        fprintf(stderr, "Error: Only the first %d workers are used\n", REMOTE_MAX_WORKERS);
+        remote->count = REMOTE_MAX_WORKERS;
+    }
+    for (unsigned int i = 0; i < remote->count; i++) {
+        atomic_store(&remote->down[i], false);
+    }
+    atomic_store(&remote->remote, 0);
+    atomic_store(&remote->fallback, 0);
+} // }}}
+bool remote_compile(const SourceFile *source, struct rusage *usage, int *status)
+{ // {{{
+    // Preprocesses the source here and compiles it on the next worker that
+    // is up, returns false when the job has to be compiled locally instead
+    struct RemoteWorkers *remote = &g_remote;
+    int worker = -1;
+    for (unsigned int i = 0; i < remote->count && worker == -1; i++) {
+        unsigned int n = atomic_fetch_add(&remote->next, 1) % remote->count;
+        if (!atomic_load(&remote->down[n])) worker = (int)n;
+    }
+    if (worker == -1) return false;
+
+    const Cmd *cmd = &source->cmd;
+    const char *extension = strrchr(source->src, '.');
+    const bool cpp = extension != NULL && strstr(extension, "cpp") != NULL;
+    char pre[PATH_MAX], received[PATH_MAX];
+    if (snprintf(pre, sizeof(pre), "%s.%s", source->obj, cpp ? "ii" : "i") >= (int)sizeof(pre)
+            || snprintf(received, sizeof(received), "%s.remote", source->obj) >= (int)sizeof(received)) {
+        return false;
+    }
+
+    // The dependency flags stay with the local preprocessor so the .d file
+    // names the headers on this machine, the worker gets everything else
+    Cmd pp = {0}, args = {0};
+    for (unsigned int i = 0; i < cmd->count; i++) {
+        const char *arg = cmd->argv[i];
+        bool takes_value = false;
+        if (!strcmp(arg, "-o")) {
+            i++;
+        } else if (!strcmp(arg, "-c")) {
+            cmd_append(&pp, "-E");
+        } else if (!strcmp(arg, "-include")) {
+            // Already part of the preprocessed source, the worker doesn't have the file
+            cmd_append(&pp, arg);
+            if (i + 1 < cmd->count) cmd_append(&pp, cmd->argv[++i]);
+        } else if (is_dependency_flag(arg, &takes_value)) {
+            cmd_append(&pp, arg);
+            if (takes_value && i + 1 < cmd->count) cmd_append(&pp, cmd->argv[++i]);
+        } else {
+            cmd_append(&pp, arg);
+            if (strcmp(arg, source->src) != 0) cmd_append(&args, arg);
+        }
+    }
+    cmd_append(&pp, "-o");
+    cmd_append(&pp, pre);
+    cmd_append(&pp, "-MF");
+    cmd_append(&pp, source->dep);
+    cmd_append(&pp, "-MT");
+    cmd_append(&pp, source->obj);
+
+    // A source that doesn't preprocess is compiled locally, which reports
+    // the error once instead of twice
+    JobOutput *output = t_job_output;
+    const size_t output_mark = output != NULL ? output->size : 0;
+    struct stat pre_stat;
+    bool ok = spawn_and_wait(&pp, NULL, usage) == 0 && stat(pre, &pre_stat) == 0;
+    cmd_free(&pp);
+    if (!ok) {
+        if (output != NULL) output->size = output_mark;
+        unlink(pre);
+        cmd_free(&args);
+        return false;
+    }
+
+    size_t args_size = 0;
+    for (unsigned int i = 0; i < args.count; i++) {
+        args_size += strlen(args.argv[i]) + 1;
+    }
+    char *arg_data = malloc(args_size > 0 ? args_size : 1);
+    char *p = arg_data;
+    for (unsigned int i = 0; arg_data != NULL && i < args.count; i++) {
+        size_t len = strlen(args.argv[i]) + 1;
+        memcpy(p, args.argv[i], len);
+        p += len;
+    }
+    cmd_free(&args);
+
+    RemoteRequest request = { .args_size = (uint32_t)args_size, .cpp = cpp, .source_size = (uint64_t)pre_stat.st_size };
+    memcpy(request.magic, REMOTE_MAGIC, sizeof(request.magic));
+    RemoteReply reply = {0};
+    char *diagnostics = NULL;
+    int fd = arg_data != NULL ? remote_socket(remote->addrs[worker], false) : -1;
+    ok = fd != -1;
+    if (ok) {
+        struct timeval timeout = { .tv_sec = REMOTE_TIMEOUT_SEC };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    ok = ok
+        && send_all(fd, &request, sizeof(request))
+        && send_all(fd, arg_data, args_size)
+        && send_file(fd, pre, request.source_size)
+        && read_all(fd, &reply, sizeof(reply));
+    if (ok && reply.output_size > 0) {
+        diagnostics = malloc(reply.output_size);
+        ok = diagnostics != NULL && read_all(fd, diagnostics, reply.output_size);
+    }
+    ok = ok && (reply.object_size == 0 || receive_file(fd, received, reply.object_size));
+    // A worker that couldn't run the compiler says nothing about the source
+    ok = ok && reply.status != 127 && (reply.status != 0 || reply.object_size > 0);
+    if (fd != -1) close(fd);
+    free(arg_data);
+    unlink(pre);
+
+    if (ok && reply.status == 0 && rename(received, source->obj) != 0) ok = false;
+    if (!ok) {
+        // The worker is left alone for the rest of the build
+        unlink(received);
+        free(diagnostics);
+        atomic_store(&remote->down[worker], true);
+        atomic_fetch_add(&remote->fallback, 1);
+        char note[512];
+        int len = snprintf(note, sizeof(note), "Worker %s failed, compiling %s locally\n",
+                remote->addrs[worker], source->src);
+        if (output != NULL && len > 0) {
+            job_output_append(output, note, len < (int)sizeof(note) ? len : (int)sizeof(note) - 1);
+        }
+        return false;
+    }
+    if (output != NULL && reply.output_size > 0) {
+        job_output_append(output, diagnostics, reply.output_size);
+    }
+    free(diagnostics);
+    if (usage != NULL) usage->ru_maxrss = reply.peak_rss_kb;
+    atomic_fetch_add(&remote->remote, 1);
+    *status = reply.status;
+    return true;
+} // }}}
+int compile_source(const SourceFile *source, struct rusage *usage)
+{ // {{{
+    // The .dwo file of a split DWARF compile stays where it was compiled
+    int status;
+    if (g_remote.count > 0 && !c_config.split_dwarf && remote_compile(source, usage, &status)) {
+        return status;
+    }
+    return build_file(&source->cmd, usage);
+} // }}}
+bool remote_flag_allowed(const char *flag, const char *value, unsigned int *used)
+{ // {{{
+    // Options that take no file and so can't load other programs or touch
+    // anything outside the scratch directory. used is set to the number of
+    // following arguments the option takes
+    static const char *const exact[] = {
+        "-c", "-w", "-pipe", "-ansi", "-pedantic", "-pedantic-errors",
+        "-fPIC", "-fpic", "-fPIE", "-fpie", "-fcommon", "-fexceptions", "-frtti",
+        "-fwrapv", "-fstrict-aliasing", "-fomit-frame-pointer", "-ffunction-sections",
+        "-fdata-sections", "-fstack-protector", "-fstack-protector-strong",
+        "-fstack-protector-all", "-fvisibility-inlines-hidden", "-fdiagnostics-color", NULL,
+    };
+    static const char *const prefixes[] = {
+        "-std=", "-fno-", "-fvisibility=", "-fsanitize=", "-fdiagnostics-color=", "-fmax-errors=", NULL,
+    };
+    static const char *const languages[] = { "c", "c++", "cpp-output", "c++-cpp-output", NULL };
+    *used = 0;
+    for (unsigned int i = 0; exact[i] != NULL; i++) {
+        if (!strcmp(flag, exact[i])) return true;
+    }
+    for (unsigned int i = 0; prefixes[i] != NULL; i++) {
+        if (!strncmp(flag, prefixes[i], strlen(prefixes[i]))) return strchr(flag, '/') == NULL;
+    }
+    if (!strncmp(flag, "-D", 2) || !strncmp(flag, "-U", 2) || !strncmp(flag, "-I", 2) || !strcmp(flag, "-x")) {
+        // The value is either part of the flag or the next argument
+        const char *arg = flag;
+        if (!strcmp(flag, "-x") || flag[2] == '\0') {
+            if (value == NULL) return false;
+            arg = value;
+            *used = 1;
+        } else {
+            arg = flag + 2;
+        }
+        if (!strcmp(flag, "-x")) {
+            for (unsigned int i = 0; languages[i] != NULL; i++) {
+                if (!strcmp(arg, languages[i])) return true;
+            }
+            return false;
+        }
+        // Include directories only name places in the tree the client shipped
+        return flag[1] != 'I' || (arg[0] != '/' && strstr(arg, "..") == NULL);
+    }
+    // -Wl, -Wa, and -Wp, hand options to other programs
+    if (!strncmp(flag, "-W", 2)) return strpbrk(flag, "=,/") == NULL;
+    if (!strncmp(flag, "-O", 2) || !strncmp(flag, "-g", 2) || !strncmp(flag, "-m", 2)) {
+        return strchr(flag, '/') == NULL;
+    }
+    return false;
+} // }}}
+bool remote_command_allowed(const Cmd *cmd, const char **refused)
+{ // {{{
+    // A worker only runs the compilers of its own config with options from
+    // remote_flag_allowed, the client compiles anything else itself
+    *refused = cmd->count > 0 ? cmd->argv[0] : "an empty command";
+    if (cmd->count == 0 || (strcmp(cmd->argv[0], c_config.cc.c) != 0 && strcmp(cmd->argv[0], c_config.cc.cpp) != 0)) {
+        return false;
+    }
+    for (unsigned int i = 1; i < cmd->count; i++) {
+        unsigned int used;
+        if (!remote_flag_allowed(cmd->argv[i], i + 1 < cmd->count ? cmd->argv[i + 1] : NULL, &used)) {
+            *refused = cmd->argv[i];
+            return false;
+        }
+        i += used;
+    }
+    return true;
+} // }}}
+void *remote_serve_connection(void *arg)
+{ // {{{
+    // Compiles one preprocessed source and streams back the compiler output
+    // and the object
+    RemoteConnection conn = *(RemoteConnection *)arg;
+    free(arg);
+    RemoteServer *server = conn.server;
+    unsigned int id = atomic_fetch_add(&server->next_id, 1);
+    RemoteRequest request;
+    char *args = NULL;
+    char src[PATH_MAX] = "", obj[PATH_MAX];
+    bool ok = read_all(conn.fd, &request, sizeof(request))
+        && !memcmp(request.magic, REMOTE_MAGIC, sizeof(request.magic))
+        && request.args_size > 0 && request.args_size <= REMOTE_MAX_ARGS
+        && (args = malloc(request.args_size + 1)) != NULL
+        && read_all(conn.fd, args, request.args_size)
+        && snprintf(obj, sizeof(obj), "%s/%u.o", server->dir, id) < (int)sizeof(obj)
+        && snprintf(src, sizeof(src), "%s/%u.%s", server->dir, id, request.cpp ? "ii" : "i") < (int)sizeof(src)
+        && receive_file(conn.fd, src, request.source_size);
+    if (!ok) {
+        fprintf(stderr, "Error: Dropped a malformed or interrupted request\n");
+        if (src[0] != '\0') unlink(src);
+        free(args);
+        close(conn.fd);
+        return NULL;
+    }
+
+    Cmd cmd = {0};
+    args[request.args_size] = '\0';
+    for (const char *p = args; p < args + request.args_size; p += strlen(p) + 1) {
+        cmd_append(&cmd, p);
+    }
+    const char *refused = NULL;
+    if (!remote_command_allowed(&cmd, &refused)) {
+        // 127 makes the client compile the source itself
+        char note[512];
+        int len = snprintf(note, sizeof(note), "Error: Worker refused to run %s\n", refused);
+        RemoteReply reply = { .status = 127, .output_size = len > 0 && len < (int)sizeof(note) ? (uint64_t)len : 0 };
+        if (send_all(conn.fd, &reply, sizeof(reply))) send_all(conn.fd, note, reply.output_size);
+        print("FAIL", "31", "Job %u: refused %s\n", id, refused);
+        fflush(stdout);
+        unlink(src);
+        cmd_free(&cmd);
+        free(args);
+        close(conn.fd);
+        return NULL;
+    }
+    cmd_append(&cmd, "-c");
+    cmd_append(&cmd, src);
+    cmd_append(&cmd, "-o");
+    cmd_append(&cmd, obj);
+
+    pthread_mutex_lock(&server->mutex);
+    while (server->running >= server->slots) {
+        pthread_cond_wait(&server->cond, &server->mutex);
+    }
+    server->running++;
+    pthread_mutex_unlock(&server->mutex);
+
+    JobOutput output = { .fd = -1 };
+    struct rusage usage = {0};
+    double start_ms = now_ms();
+    t_job_output = &output;
+    RemoteReply reply = { .status = spawn_and_wait(&cmd, NULL, &usage) };
+    t_job_output = NULL;
+
+    pthread_mutex_lock(&server->mutex);
+    server->running--;
+    pthread_cond_signal(&server->cond);
+    pthread_mutex_unlock(&server->mutex);
+
+    struct stat obj_stat;
+    reply.peak_rss_kb = (uint32_t)usage.ru_maxrss;
+    reply.output_size = output.size;
+    reply.object_size = reply.status == 0 && stat(obj, &obj_stat) == 0 ? (uint64_t)obj_stat.st_size : 0;
+    ok = send_all(conn.fd, &reply, sizeof(reply))
+        && send_all(conn.fd, output.data, output.size)
+        && (reply.object_size == 0 || send_file(conn.fd, obj, reply.object_size));
+    print(reply.status == 0 ? "DONE" : "FAIL", reply.status == 0 ? "32" : "31",
+            "Job %u: %s in %.0f ms%s\n", id, cmd.argv[0], now_ms() - start_ms, ok ? "" : ", the client went away");
+    fflush(stdout);
+
+    unlink(src);
+    unlink(obj);
+    free(output.data);
+    cmd_free(&cmd);
+    free(args);
+    close(conn.fd);
+    return NULL;
+} // }}}
+int remote_serve(const char *addr, int slots)
+{ // {{{
+    // Runs until killed. Requests may only name the compilers of this config
+    // and no options that load other code, but the sources they compile are
+    // still the client's, so only listen where every client is trusted
+    static RemoteServer server = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    server.slots = slots > 0 ? (unsigned int)slots : 1;
+    const char *tmp = getenv("TMPDIR");
+    snprintf(server.dir, sizeof(server.dir), "%s/build-worker-XXXXXX", tmp != NULL ? tmp : "/tmp");
+    if (mkdtemp(server.dir) == NULL) {
+        fprintf(stderr, "Error: Failed to create a scratch directory in %s: %s\n", tmp != NULL ? tmp : "/tmp", strerror(errno));
+        return -1;
+    }
+    int listen_fd = remote_socket(addr, true);
+    if (listen_fd == -1) {
+        fprintf(stderr, "Error: Failed to listen on %s: %s\n", addr, strerror(errno));
+        rmdir(server.dir);
+        return -1;
+    }
+    print("INF", "1", "Compiling for other builds on %s with %u slots\n", addr, server.slots);
+    fflush(stdout);
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: accept failed on %s: %s\n", addr, strerror(errno));
+            break;
+        }
+        // Each connection carries one job and waits for a slot on its own thread
+        RemoteConnection *conn = malloc(sizeof(RemoteConnection));
+        pthread_t thread;
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        *conn = (RemoteConnection){ .server = &server, .fd = fd };
+        if (pthread_create(&thread, NULL, remote_serve_connection, conn) != 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(listen_fd);
+    rmdir(server.dir);
+    return -1;
+} // }}}
+
+// Object cache functions
+struct ObjectCache {
+    const char *compilers[4];  // Compilers whose identity has been looked up
+    uint64_t identities[4];    // Hash of the --version output of each compiler
+    bool clang[4];             // Set for compilers that report a clang version
+    unsigned int count;        // Number of compilers looked up
+    pthread_mutex_t mutex;     // Guards the compiler identities
+    atomic_uint hits;          // Objects copied out of the cache
+    atomic_uint misses;        // Objects that had to be compiled
+    atomic_uint stored;        // Objects added to the cache
+    atomic_uint tmp_counter;   // Makes temporary file names unique between workers
+} g_object_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+void object_cache_reset()
+{ // {{{
+    // A daemon serves many builds, each counts its own hits and looks the
+    // compilers up again in case one was upgraded since the last build
+    struct ObjectCache *cache = &g_object_cache;
+    pthread_mutex_lock(&cache->mutex);
+    cache->count = 0;
+    pthread_mutex_unlock(&cache->mutex);
+    atomic_store(&cache->hits, 0);
+    atomic_store(&cache->misses, 0);
+    atomic_store(&cache->stored, 0);
+} // }}}
+uint64_t compiler_identity(const char *compiler, bool *clang)
+{ // {{{
+    // Identifies a compiler by its version output, looked up once per build.
+    // A clang installed as gcc or cc is still told apart by the output
+    struct ObjectCache *cache = &g_object_cache;
+    pthread_mutex_lock(&cache->mutex);
+    for (unsigned int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->compilers[i], compiler) == 0) {
+            uint64_t identity = cache->identities[i];
+            if (clang != NULL) *clang = cache->clang[i];
+            pthread_mutex_unlock(&cache->mutex);
+            return identity;
+        }
+    }
+
+    uint64_t identity = hash_string(compiler, 0);
+    bool is_clang = false;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        Cmd cmd = {0};
+        cmd_append(&cmd, compiler);
+        cmd_append(&cmd, "--version");
+        spawn_and_wait(&cmd, &actions, NULL);
+        cmd_free(&cmd);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(fds[0], buf, sizeof(buf) - 1)) > 0) {
+            identity = hash_bytes(buf, len, identity);
+            buf[len] = '\0';
+            if (strstr(buf, "clang version") != NULL) is_clang = true;
+        }
+        close(fds[0]);
+    }
+    if (cache->count < sizeof(cache->compilers) / sizeof(cache->compilers[0])) {
+        cache->compilers[cache->count] = compiler;
+        cache->clang[cache->count] = is_clang;
+        cache->identities[cache->count++] = identity;
+    }
+    if (clang != NULL) *clang = is_clang;
+    pthread_mutex_unlock(&cache->mutex);
+    return identity;
+} // }}}
+bool copy_file(const char *src, const char *dst)
+{ // {{{
+    // Copies through a temporary file so readers never see a partial file,
+    // a reflink is tried first, then copy_file_range, then plain reads
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.%u.tmp", dst, (int)getpid(),
+                atomic_fetch_add(&g_object_cache.tmp_counter, 1)) >= (int)sizeof(tmp)) {
+        return false;
+    }
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in == -1) return false;
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1) {
+        close(in);
+        return false;
+    }
+
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    if (!ok) {
+        ok = true;
+        ssize_t copied;
+        while ((copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {}
+        if (copied == -1) {
+            // Not supported between these files, fall back to a read/write loop
+            char buf[65536];
+            ssize_t len = -1;
+            ok = lseek(in, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0 && lseek(out, 0, SEEK_SET) == 0;
+            while (ok && (len = read(in, buf, sizeof(buf))) > 0) {
+                ok = write(out, buf, len) == len;
+            }
+            if (len == -1) ok = false;
+        }
+    }
+    close(in);
+    if (close(out) != 0) ok = false;
+    if (!ok || rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+} // }}}
+bool object_cache_key(const SourceFile *source, char *key, size_t key_size)
+{ // {{{
+    // The key covers the compiler identity, every argument except the output
+    // and dependency flags, and the preprocessed source
+    const Cmd *cmd = &source->cmd;
+    char pre[PATH_MAX];
+    if (snprintf(pre, sizeof(pre), "%s.i", source->obj) >= (int)sizeof(pre)) return false;
+
+    Cmd pp = {0};
+    uint64_t h = compiler_identity(cmd->argv[0], NULL);
+    for (unsigned int i = 0; i < cmd->count; i++) {
+        const char *arg = cmd->argv[i];
+        bool takes_value = false;
+        if (!strcmp(arg, "-o") || is_dependency_flag(arg, &takes_value)) {
+            if (!strcmp(arg, "-o") || takes_value) i++;
+            continue;
+        }
+        h = hash_bytes(arg, strlen(arg) + 1, h);
+        cmd_append(&pp, !strcmp(arg, "-c") ? "-E" : arg);
+    }
+    cmd_append(&pp, "-o");
+    cmd_append(&pp, pre);
+    int status = spawn_and_wait(&pp, NULL, NULL);
+    cmd_free(&pp);
+
+    uint64_t lo = 0, hi = 0;
+    bool ok = status == 0
+        && hash_file(pre, h, &lo)
+        && hash_file(pre, ~h, &hi);
+    unlink(pre);
+    if (!ok) return false;
+    snprintf(key, key_size, "%016llx%016llx", (unsigned long long)lo, (unsigned long long)hi);
+    return true;
+} // }}}
+int compile_cached(const SourceFile *source, struct rusage *usage, bool *hit)
+{ // {{{
+    const Cache *cache = &c_config.cache;
+    char key[33], cached_obj[PATH_MAX], cached_dep[PATH_MAX], cached_dir[PATH_MAX];
+    if (!object_cache_key(source, key, sizeof(key))
+            || snprintf(cached_dir, sizeof(cached_dir), "%s/%.2s", cache->dir, key) >= (int)sizeof(cached_dir)
+            || snprintf(cached_obj, sizeof(cached_obj), "%s/%s.o", cached_dir, key) >= (int)sizeof(cached_obj)
+            || snprintf(cached_dep, sizeof(cached_dep), "%s/%s.d", cached_dir, key) >= (int)sizeof(cached_dep)) {
+        // Let the compiler report whatever stopped the source from preprocessing
+        return build_file(&source->cmd, usage);
+    }
+
+    if (access(cached_obj, F_OK) == 0
+            && copy_file(cached_dep, source->dep)
+            && copy_file(cached_obj, source->obj)) {
+        utimensat(AT_FDCWD, cached_obj, NULL, 0); // Mark the entry as recently used
+        atomic_fetch_add(&g_object_cache.hits, 1);
+        *hit = true;
+        return 0;
+    }
+    atomic_fetch_add(&g_object_cache.misses, 1);
+
+    int status = compile_source(source, usage);
+    if (status == 0) {
+        // The .d file goes in first so an entry with an object is always complete
+        recursive_mkdir(cached_dir);
+        if (copy_file(source->dep, cached_dep) && copy_file(source->obj, cached_obj)) {
+            atomic_fetch_add(&g_object_cache.stored, 1);
+        }
+    }
+    return status;
+} // }}}
+typedef struct CacheEntry {
+    char *path;   // Path of the cached object without its extension
+    time_t mtime; // Last time the entry was stored or used
+    off_t size;   // Combined size of the object and dependency file
+} CacheEntry;
+
+int compare_cache_entries(const void *a, const void *b)
+{ // {{{
+    const CacheEntry *lhs = (const CacheEntry *)a, *rhs = (const CacheEntry *)b;
+    return (lhs->mtime > rhs->mtime) - (lhs->mtime < rhs->mtime);
+} // }}}
+void object_cache_evict(const Cache *cache)
+{ // {{{
+    // Removes the least recently used entries until the cache is back under
+    // 90% of its size limit
+    DIR *root = opendir(cache->dir);
+    if (root == NULL) return;
+    CacheEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    off_t total = 0;
+    struct dirent *sub;
+    while ((sub = readdir(root)) != NULL) {
+        if (sub->d_name[0] == '.') continue;
+        char sub_path[PATH_MAX];
+        snprintf(sub_path, sizeof(sub_path), "%s/%s", cache->dir, sub->d_name);
+        DIR *dir = opendir(sub_path);
+        if (dir == NULL) continue;
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            size_t len = strlen(ent->d_name);
+            if (len < 3 || strcmp(ent->d_name + len - 2, ".o") != 0) continue;
+            char path[PATH_MAX];
+            struct stat obj_stat, dep_stat;
+            if (snprintf(path, sizeof(path), "%s/%.*s", sub_path, (int)(len - 2), ent->d_name) >= (int)sizeof(path) - 2) continue;
+            strcat(path, ".o");
+            if (stat(path, &obj_stat) != 0) continue;
+            path[strlen(path) - 1] = 'd';
+            if (stat(path, &dep_stat) != 0) dep_stat.st_size = 0;
+            path[strlen(path) - 2] = '\0';
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                CacheEntry *grown = realloc(entries, capacity * sizeof(CacheEntry));
+                if (grown == NULL) break;
+                entries = grown;
+            }
+            entries[count++] = (CacheEntry){ strdup(path), obj_stat.st_mtime, obj_stat.st_size + dep_stat.st_size };
+            total += obj_stat.st_size + dep_stat.st_size;
+        }
+        closedir(dir);
+    }
+    closedir(root);
+
+    const off_t limit = (off_t)cache->max_size * 1024 * 1024;
+    if (total > limit) {
+        qsort(entries, count, sizeof(CacheEntry), compare_cache_entries);
+        unsigned int evicted = 0;
+        for (size_t i = 0; i < count && total > limit / 10 * 9; i++) {
+            if (entries[i].path == NULL) continue;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s.o", entries[i].path);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s.d", entries[i].path);
+            unlink(path);
+            total -= entries[i].size;
+            evicted++;
+        }
+        print("INF", "1", "Evicted %u objects from the cache %s\n", evicted, cache->dir);
+    }
+    for (size_t i = 0; i < count; i++) free(entries[i].path);
+    free(entries);
+} // }}}
+
+// Jobserver functions
+typedef struct JobToken {
+    bool implicit; // Set when the job runs on the token every process starts with
+    bool held;     // Set when a token was read from the jobserver
+    char value;    // Byte read from the jobserver, written back as it was
+} JobToken;
+
+struct Jobserver {
+    int read_fd;                // Non-blocking read end of the jobserver, -1 without a jobserver
+    int write_fd;               // End the tokens are given back to
+    atomic_bool implicit_taken; // Set while a job runs on the implicit token
+    char fifo_path[PATH_MAX];   // Fifo created when this process is the jobserver, empty otherwise
+} g_jobserver = { .read_fd = -1, .write_fd = -1 };
+
+bool jobserver_connect()
+{ // {{{
+    // Joins the jobserver of a parent make, MAKEFLAGS names it with
+    // --jobserver-auth=fifo:PATH or as an inherited pipe with R,W
+    const char *flags = getenv("MAKEFLAGS");
+    if (flags == NULL) return false;
+    const char *auth = NULL;
+    for (const char *p = flags; (p = strstr(p, "--jobserver-")) != NULL; p++) {
+        // make appends to MAKEFLAGS, so the last one is the closest jobserver
+        if (!strncmp(p, "--jobserver-auth=", 17)) auth = p + 17;
+        else if (!strncmp(p, "--jobserver-fds=", 16)) auth = p + 16;
+    }
+    if (auth == NULL) return false;
+    char value[PATH_MAX];
+    const size_t len = strcspn(auth, " ");
+    if (len >= sizeof(value)) return false;
+    memcpy(value, auth, len);
+    value[len] = '\0';
+
+    if (!strncmp(value, "fifo:", 5)) {
+        g_jobserver.read_fd = open(value + 5, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        g_jobserver.write_fd = open(value + 5, O_WRONLY | O_CLOEXEC);
+    } else {
+        // make only hands the pipe to recipes marked with +, otherwise the
+        // descriptors are closed or belong to something else
+        int read_fd, write_fd;
+        if (sscanf(value, "%d,%d", &read_fd, &write_fd) != 2 || read_fd < 0 || write_fd < 0
+                || fcntl(read_fd, F_GETFD) == -1 || fcntl(write_fd, F_GETFD) == -1) {
+            return false;
+        }
+        // A description of our own can be non-blocking without changing the
+        // pipe make reads from
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", read_fd);
+        g_jobserver.read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        g_jobserver.write_fd = fcntl(write_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (g_jobserver.read_fd == -1 || g_jobserver.write_fd == -1) {
+        fprintf(stderr, "Error: Failed to open the jobserver %s: %s\n", value, strerror(errno));
+        if (g_jobserver.read_fd != -1) close(g_jobserver.read_fd);
+        if (g_jobserver.write_fd != -1) close(g_jobserver.write_fd);
+        g_jobserver.read_fd = g_jobserver.write_fd = -1;
+        return false;
+    }
+    return true;
+} // }}}
+void jobserver_shutdown()
+{ // {{{
+    // Removes the fifo of the jobserver this process serves, the tokens go
+    // away with the last open end
+    if (g_jobserver.fifo_path[0] == '\0') return;
+    unlink(g_jobserver.fifo_path);
+    g_jobserver.fifo_path[0] = '\0';
+} // }}}
+void jobserver_remove_stale(const char *dir)
+{ // {{{
+    // A build stopped by a signal never removes its fifo, the pid in the name
+    // tells whether its server is still around
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int pid = 0;
+        if (sscanf(entry->d_name, "jobserver.%d", &pid) != 1 || pid <= 0) continue;
+        if (kill(pid, 0) == 0 || errno != ESRCH) continue;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) < (int)sizeof(path)) unlink(path);
+    }
+    closedir(d);
+} // }}}
+bool jobserver_serve(const char *dir, int tokens)
+{ // {{{
+    // Serves tokens to the processes this build starts and to its own
+    // workers through a fifo announced in MAKEFLAGS like make 4.4 does, so
+    // nested builds and makes share the thread count of this build. The
+    // path is absolute since children may run in another directory
+    char abs_dir[PATH_MAX];
+    if (realpath(dir, abs_dir) == NULL
+            || snprintf(g_jobserver.fifo_path, sizeof(g_jobserver.fifo_path), "%s/jobserver.%d", abs_dir, (int)getpid())
+            >= (int)sizeof(g_jobserver.fifo_path)) {
+        fprintf(stderr, "Error: Failed to place the jobserver in %s\n", dir);
+        g_jobserver.fifo_path[0] = '\0';
+        return false;
+    }
+    jobserver_remove_stale(abs_dir);
+    if (mkfifo(g_jobserver.fifo_path, S_IRUSR | S_IWUSR) != 0) {
+        fprintf(stderr, "Error: Failed to create the jobserver %s: %s\n", g_jobserver.fifo_path, strerror(errno));
+        g_jobserver.fifo_path[0] = '\0';
+        return false;
+    }
+    static bool registered = false;
+    if (!registered) {
+        atexit(jobserver_shutdown);
+        registered = true;
+    }
+    g_jobserver.read_fd = open(g_jobserver.fifo_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    g_jobserver.write_fd = open(g_jobserver.fifo_path, O_WRONLY | O_CLOEXEC);
+    bool ok = g_jobserver.read_fd != -1 && g_jobserver.write_fd != -1;
+    for (int i = 0; ok && i < tokens; i++) {
+        ok = write(g_jobserver.write_fd, "+", 1) == 1;
+    }
+
+    // Later flags win, so the jobserver is appended to whatever MAKEFLAGS holds
+    const char *flags = getenv("MAKEFLAGS");
+    char *value = NULL;
+    ok = ok && asprintf(&value, "%s%s-j%d --jobserver-auth=fifo:%s", flags != NULL ? flags : "",
+            flags != NULL && flags[0] != '\0' ? " " : "", tokens + 1, g_jobserver.fifo_path) != -1;
+    if (!ok || setenv("MAKEFLAGS", value, 1) != 0) {
+        fprintf(stderr, "Error: Failed to start the jobserver %s\n", g_jobserver.fifo_path);
+        if (g_jobserver.read_fd != -1) close(g_jobserver.read_fd);
+        if (g_jobserver.write_fd != -1) close(g_jobserver.write_fd);
+        g_jobserver.read_fd = g_jobserver.write_fd = -1;
+        jobserver_shutdown();
+        free(value);
+        return false;
+    }
+    free(value);
+    return true;
+} // }}}
+JobToken jobserver_acquire()
+{ // {{{
+    // Every process runs one job on the token it was started with, any
+    // further job waits for a token from the jobserver. Returns without a
+    // token when there is no jobserver or it broke, so the build goes on
+    JobToken token = {0};
+    if (g_jobserver.read_fd == -1) return token;
+    for (;;) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&g_jobserver.implicit_taken, &expected, true)) {
+            token.implicit = true;
+            return token;
+        }
+        ssize_t got = read(g_jobserver.read_fd, &token.value, 1);
+        if (got == 1) {
+            token.held = true;
+            return token;
+        }
+        if (got == 0 || (errno != EAGAIN && errno != EINTR)) return token;
+        // Looks at the implicit token again now and then, it is given back
+        // without waking anyone
+        struct pollfd pfd = { .fd = g_jobserver.read_fd, .events = POLLIN };
+        poll(&pfd, 1, 50);
+    }
+} // }}}
+void jobserver_release(JobToken token)
+{ // {{{
+    if (token.implicit) {
+        atomic_store(&g_jobserver.implicit_taken, false);
+    } else if (token.held) {
+        while (write(g_jobserver.write_fd, &token.value, 1) == -1 && errno == EINTR) {}
+    }
+} // }}}
+
+// Job queue functions
+typedef struct Job {
+    Cmd *cmd;           // Command used to build the target
+    SourceFile *source; // Source file the job compiles, NULL for a link
+    struct BuildTarget *target; // Target the job links, NULL for a compile
+    const char *name;   // Source or target shown in the progress line and the trace
+    uint32_t id;        // Record of the output in the build database
+    unsigned int index; // Index of the source file the job builds
+    int status;         // Exit status of the command once it has been run
+    int slot;           // Worker slot the job ran on
+    bool cached;        // Set when the object was copied out of the object cache
+    JobOutput output;   // Output of the processes the job ran
+    double cost_ms;     // Expected run time used to order the queue
+    uint64_t mem_kb;    // Expected peak memory used to admit the job within the memory budget
+    double start_ms;    // Monotonic time the job was picked up
+    double end_ms;      // Monotonic time the job finished
+    double ready_ms;    // Time the prediction lets the job start, once the jobs it waits for are done
+    struct rusage usage; // Resources used by the process the job ran
+    unsigned int waiting;    // Jobs that have to finish before this one starts, guarded by the queue mutex
+    struct Job **waiters;    // Jobs waiting for this one
+    unsigned int waiter_count;
+    unsigned int waiter_capacity;
+    bool input_failed;  // Set when a job this one waited for failed
+    bool cut_off;       // Set when the output came out the same as last time, or a link wasn't needed
+} Job;
+
+typedef struct JobQueue {
+    Job **jobs;            // Jobs waiting to be picked up by a worker
+    unsigned int head;     // Index of the next job to hand out
+    unsigned int tail;     // Index one past the last queued job
+    unsigned int capacity; // Number of job slots allocated
+    unsigned int failed;   // Number of jobs that finished with a non-zero status
+    unsigned int reported; // Number of finished jobs printed, guarded by g_thread_print_mutex
+    unsigned int running;  // Number of jobs handed out that haven't finished yet
+    unsigned int delayed;  // Number of times a worker waited for the load or memory to allow a job
+    double max_load;       // Jobs only start while the system load is below this, 0 disables the limit
+    uint64_t mem_budget_kb; // Memory the running jobs may use together, 0 disables the limit
+    uint64_t mem_in_use_kb; // Expected memory of the running jobs
+    bool closed;           // Set once no more jobs will be pushed
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} JobQueue;
+
+typedef struct Worker {
+    JobQueue *queue; // Queue the worker pulls jobs from
+    int slot;        // Index of the worker in the pool
+} Worker;
+
+bool job_wait_for(Job *job, Job *prerequisite, Arena *arena)
+{ // {{{
+    // Holds the job back until the prerequisite finished
+    if (prerequisite->waiter_count == prerequisite->waiter_capacity) {
+        unsigned int capacity = prerequisite->waiter_capacity ? prerequisite->waiter_capacity * 2 : 4;
+        Job **waiters = arena_alloc(arena, capacity * sizeof(Job *));
+        if (waiters == NULL) return false;
+        if (prerequisite->waiter_count > 0) {
+            memcpy(waiters, prerequisite->waiters, prerequisite->waiter_count * sizeof(Job *));
+        }
+        prerequisite->waiters = waiters;
+        prerequisite->waiter_capacity = capacity;
+    }
+    prerequisite->waiters[prerequisite->waiter_count++] = job;
+    job->waiting++;
+    return true;
+} // }}}
+bool job_queue_init(JobQueue *queue, unsigned int capacity)
+{ // {{{
+    memset(queue, 0, sizeof(*queue));
+    queue->capacity = capacity > 0 ? capacity : 1;
+    queue->jobs = malloc(queue->capacity * sizeof(Job *));
+    if (queue->jobs == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the job queue\n");
+        return false;
+    }
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    return true;
+} // }}}
+void job_queue_destroy(JobQueue *queue)
+{ // {{{
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->jobs);
+    queue->jobs = NULL;
+} // }}}
+bool job_queue_push(JobQueue *queue, Job *job)
+{ // {{{
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail == queue->capacity) {
+        Job **jobs = realloc(queue->jobs, queue->capacity * 2 * sizeof(Job *));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&queue->mutex);
+            fprintf(stderr, "Error: Failed to grow the job queue\n");
+            return false;
+        }
+        queue->jobs = jobs;
+        queue->capacity *= 2;
+    }
+    queue->jobs[queue->tail++] = job;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+} // }}}
+void job_queue_close(JobQueue *queue)
+{ // {{{
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+} // }}}
+double system_load()
+{ // {{{
+    // Like make, the number of runnable threads is used rather than the one
+    // minute average, which only catches up long after the jobs started
+    FILE *fp = fopen("/proc/loadavg", "r");
+    int runnable = 0;
+    if (fp != NULL) {
+        if (fscanf(fp, "%*f %*f %*f %d/", &runnable) != 1) runnable = 0;
+        fclose(fp);
+    }
+    if (runnable > 0) return runnable - 1; // Without the thread asking
+    double load = 0;
+    return getloadavg(&load, 1) == 1 ? load : 0;
+} // }}}
+uint64_t mem_available_kb()
+{ // {{{
+    // Memory that can be handed out without swapping, 0 when unknown
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp == NULL) return 0;
+    char line[256];
+    unsigned long kb = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+} // }}}
+Job *job_queue_admit(JobQueue *queue, bool *throttled)
+{ // {{{
+    // Hands out the first queued job whose dependency finished and that fits
+    // the load and memory limits, the mutex must be held. A job is always
+    // started when nothing runs, so a job larger than the whole budget still
+    // gets built
+    *throttled = false;
+    if (queue->running > 0 && queue->max_load > 0 && system_load() >= queue->max_load) {
+        *throttled = true;
+        return NULL;
+    }
+    bool over_budget = false;
+    for (unsigned int i = queue->head; i < queue->tail; i++) {
+        Job *job = queue->jobs[i];
+        if (job->waiting > 0) {
+            continue; // Its dependencies are running or ahead of it
+        }
+        if (queue->running > 0 && queue->mem_budget_kb > 0
+                && queue->mem_in_use_kb + job->mem_kb > queue->mem_budget_kb) {
+            over_budget = true;
+            continue;
+        }
+        // Smaller jobs further back fill the budget, the ones skipped keep their order
+        memmove(&queue->jobs[queue->head + 1], &queue->jobs[queue->head], (i - queue->head) * sizeof(Job *));
+        queue->jobs[queue->head++] = job;
+        queue->running++;
+        queue->mem_in_use_kb += job->mem_kb;
+        return job;
+    }
+    *throttled = over_budget;
+    return NULL;
+} // }}}
+Job *job_queue_pop(JobQueue *queue)
+{ // {{{
+    // Blocks until a job is available and admitted or the queue has been
+    // closed and drained
+    pthread_mutex_lock(&queue->mutex);
+    Job *job = NULL;
+    bool was_throttled = false;
+    for (;;) {
+        bool throttled = false;
+        if (queue->head < queue->tail) {
+            job = job_queue_admit(queue, &throttled);
+            if (job != NULL) break;
+        } else if (queue->closed) {
+            break;
+        }
+        if (throttled && !was_throttled) queue->delayed++;
+        was_throttled = throttled;
+        if (throttled && queue->max_load > 0) {
+            // The load changes without any job finishing, so look again soon
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&queue->cond, &queue->mutex, &deadline);
+        } else {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+} // }}}
+void job_queue_finish(JobQueue *queue, Job *job)
+{ // {{{
+    // Gives the memory of the job back and wakes the workers waiting for it
+    // or for the job to finish
+    pthread_mutex_lock(&queue->mutex);
+    for (unsigned int i = 0; i < job->waiter_count; i++) {
+        job->waiters[i]->waiting--;
+        if (job->status != 0) job->waiters[i]->input_failed = true;
+    }
+    queue->running--;
+    queue->mem_in_use_kb -= job->mem_kb;
+    if (job->status != 0) queue->failed++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+} // }}}
+
+int compare_jobs_by_cost(const void *a, const void *b)
+{ // {{{
+    // Precompiled headers and links first since other jobs wait for them,
+    // then longest first, ties keep the order of the config so the schedule
+    // is stable
+    const Job *job_a = *(const Job *const *)a, *job_b = *(const Job *const *)b;
+    int rank_a = job_a->target != NULL ? 1 : job_a->source->is_pch ? 0 : 2;
+    int rank_b = job_b->target != NULL ? 1 : job_b->source->is_pch ? 0 : 2;
+    if (rank_a != rank_b) return rank_a - rank_b;
+    if (job_a->cost_ms != job_b->cost_ms) return job_a->cost_ms < job_b->cost_ms ? 1 : -1;
+    return job_a->index < job_b->index ? -1 : job_a->index > job_b->index;
+} // }}}
+unsigned int estimate_job_costs(Job *jobs[], unsigned int count)
+{ // {{{
+    // Jobs cost the time and memory they took last time, sources without a
+    // history are estimated from their size at the rate the known ones
+    // compiled at and the average memory of the known ones, returns the
+    // number of compiles with a timing history
+    unsigned int known = 0, known_mem = 0;
+    double known_ms = 0, known_bytes = 0;
+    uint64_t known_kb = 0;
+    int64_t sizes[count > 0 ? count : 1];
+    for (unsigned int i = 0; i < count; i++) {
+        StatEntry src_stat;
+        sizes[i] = jobs[i]->source != NULL && stat_cache_get(jobs[i]->source->src, &src_stat) ? src_stat.size : 0;
+        const FileRecord *record = &build_db.files[jobs[i]->id];
+        jobs[i]->cost_ms = record->duration_ms;
+        jobs[i]->mem_kb = record->peak_rss_kb;
+        if (record->duration_ms > 0 && jobs[i]->source != NULL && !jobs[i]->source->is_pch) {
+            known++;
+            known_ms += record->duration_ms;
+            known_bytes += sizes[i];
+        }
+        if (record->peak_rss_kb > 0) {
+            known_mem++;
+            known_kb += record->peak_rss_kb;
+        }
+    }
+    const double ms_per_byte = known_bytes > 0 ? known_ms / known_bytes : 1;
+    for (unsigned int i = 0; i < count; i++) {
+        if (jobs[i]->cost_ms == 0) jobs[i]->cost_ms = sizes[i] * ms_per_byte;
+        if (jobs[i]->mem_kb == 0 && known_mem > 0) jobs[i]->mem_kb = known_kb / known_mem;
+    }
+    return known;
+} // }}}
+double predict_makespan(Job *const jobs[], unsigned int count, int worker_count)
+{ // {{{
+    // Replays the queue in order, each job going to the worker that frees up
+    // first but not before the jobs it waits for are done
+    if (worker_count < 1) worker_count = 1;
+    double busy_until[worker_count];
+    for (int i = 0; i < worker_count; i++) busy_until[i] = 0;
+    for (unsigned int i = 0; i < count; i++) jobs[i]->ready_ms = 0;
+    double makespan = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (jobs[i]->target != NULL) continue; // Links wait for the compiles and aren't predicted
+        int next = 0;
+        for (int w = 1; w < worker_count; w++) {
+            if (busy_until[w] < busy_until[next]) next = w;
+        }
+        double start = busy_until[next] > jobs[i]->ready_ms ? busy_until[next] : jobs[i]->ready_ms;
+        busy_until[next] = start + jobs[i]->cost_ms;
+        for (unsigned int w = 0; w < jobs[i]->waiter_count; w++) {
+            Job *waiter = jobs[i]->waiters[w];
+            if (waiter->ready_ms < busy_until[next]) waiter->ready_ms = busy_until[next];
+        }
+        if (busy_until[next] > makespan) makespan = busy_until[next];
+    }
+    return makespan;
+} // }}}
+
+// Target functions
+#define TARGET_MAX 64
+
+typedef struct BuildTarget {
+    const char *name;         // Output file name inside the mode directory
+    TargetKind kind;          // Executable, static archive or shared object
+    const char *const *src;   // Sources from the config, may hold glob patterns
+    const char *const *link;  // Names of the targets linked into this one
+    char output[PATH_MAX];    // Path of the linked output
+    char obj_dir[PATH_MAX];   // Directory the objects of the target are written to
+    PathList sources;         // Expanded sources, or the unity batches that include them
+    unsigned int links[TARGET_MAX];   // Targets linked in directly
+    unsigned int link_count;
+    unsigned int closure[TARGET_MAX]; // Targets whose outputs go on the link line, dependents first
+    unsigned int closure_count;
+    const struct BuildTarget *targets; // Every target of the build
+    SourceFile *files;        // Source files of the target
+    unsigned int file_count;
+    Cmd cmd;                  // Command that links the target
+    uint32_t id;              // Record of the output in the build database
+    bool cpp;                 // Set when the target has C++ sources
+    bool pic;                 // Set when the objects end up in a shared object
+} BuildTarget;
+
+void targets_free(BuildTarget targets[], unsigned int count)
+{ // {{{
+    for (unsigned int i = 0; i < count; i++) {
+        path_list_free(&targets[i].sources);
+        cmd_free(&targets[i].cmd);
+    }
+    free(targets);
+} // }}}
+bool target_visit(const BuildTarget targets[], unsigned int t, unsigned char state[])
+{ // {{{
+    // Depth first over the links, a target met again while it is still being
+    // visited closes a cycle
+    state[t] = 1;
+    for (unsigned int i = 0; i < targets[t].link_count; i++) {
+        unsigned int d = targets[t].links[i];
+        if (state[d] == 1) {
+            fprintf(stderr, "Error: Targets %s and %s link against each other\n", targets[t].name, targets[d].name);
+            return false;
+        }
+        if (state[d] == 0 && !target_visit(targets, d, state)) return false;
+    }
+    state[t] = 2;
+    return true;
+} // }}}
+void target_collect(BuildTarget *target, unsigned int t, bool seen[])
+{ // {{{
+    // The targets a static archive links come along with it, a shared object
+    // already carries its own. Collected after their dependencies and in
+    // reverse, so the reversed list keeps the order of the config
+    const BuildTarget *targets = target->targets;
+    for (unsigned int i = targets[t].link_count; i-- > 0;) {
+        unsigned int d = targets[t].links[i];
+        if (seen[d]) continue;
+        seen[d] = true;
+        if (targets[d].kind == TARGET_STATIC) target_collect(target, d, seen);
+        target->closure[target->closure_count++] = d;
+    }
+} // }}}
+BuildTarget *targets_init(const config_t *config, const InternalConfig *internal_config, unsigned int *count)
+{ // {{{
+    // exe is the first target followed by the targets from the config, each
+    // with its sources expanded. The objects of exe stay at the top of the
+    // mode directory, the other targets get a directory of their own
+    unsigned int total = 1;
+    while (config->targets != NULL && config->targets[total - 1].name != NULL) total++;
+    if (total > TARGET_MAX) {
+        fprintf(stderr, "Error: Only %d targets are supported\n", TARGET_MAX);
+        return NULL;
+    }
+    BuildTarget *targets = calloc(total, sizeof(BuildTarget));
+    if (targets == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the targets\n");
+        return NULL;
+    }
+    bool ok = true;
+    for (unsigned int t = 0; t < total && ok; t++) {
+        BuildTarget *target = &targets[t];
+        const Target main_target = { .name = config->exe, .kind = TARGET_EXECUTABLE, .src = config->src, .link = config->link };
+        const Target *decl = t == 0 ? &main_target : &config->targets[t - 1];
+        *target = (BuildTarget){ .name = decl->name, .kind = decl->kind, .src = decl->src, .link = decl->link, .targets = targets };
+        if (target->name == NULL || target->src == NULL) {
+            fprintf(stderr, "Error: Target %u needs a name and src\n", t);
+            ok = false;
+            break;
+        }
+        for (unsigned int i = 0; i < t && ok; i++) {
+            if (strcmp(targets[i].name, target->name) == 0) {
+                fprintf(stderr, "Error: Target %s is declared twice\n", target->name);
+                ok = false;
+            }
+        }
+        if (ok && (snprintf(target->output, sizeof(target->output), "%s/%s", internal_config->out_dir, target->name) >= (int)sizeof(target->output)
+                || snprintf(target->obj_dir, sizeof(target->obj_dir), t == 0 ? "%s" : "%s/%s.dir",
+                    internal_config->out_dir, target->name) >= (int)sizeof(target->obj_dir))) {
+            fprintf(stderr, "Error: Output path of %s is too long\n", target->name);
+            ok = false;
+        }
+
+        config_t target_config = *config;
+        target_config.src = target->src;
+        ok = ok && expand_sources(&target_config, &target->sources);
+        if (ok && target->sources.count == 0) {
+            fprintf(stderr, "Error: No source files matched src of %s\n", target->name);
+            ok = false;
+        }
+        if (ok && internal_config->unity) {
+            PathList batched = {0};
+            ok = unity_batch_sources(config, target->name, target->obj_dir,
+                    (const char *const *)target->sources.paths, &batched);
+            path_list_free(&target->sources);
+            target->sources = batched;
+        }
+    }
+
+    // Libraries are linked by name, an executable can't be linked into anything
+    for (unsigned int t = 0; t < total && ok; t++) {
+        BuildTarget *target = &targets[t];
+        for (unsigned int i = 0; target->link != NULL && target->link[i] != NULL && ok; i++) {
+            unsigned int d = 0;
+            while (d < total && strcmp(targets[d].name, target->link[i]) != 0) d++;
+            if (d == total || targets[d].kind == TARGET_EXECUTABLE) {
+                fprintf(stderr, "Error: %s links against %s which is not a library target\n", target->name, target->link[i]);
+                ok = false;
+            } else if (target->link_count < TARGET_MAX) {
+                target->links[target->link_count++] = d;
+            }
+        }
+    }
+    unsigned char state[TARGET_MAX] = {0};
+    for (unsigned int t = 0; t < total && ok; t++) {
+        if (state[t] == 0) ok = target_visit(targets, t, state);
+    }
+    for (unsigned int t = 0; t < total && ok; t++) {
+        // A static archive has to come before the archives it uses on the link line
+        bool seen[TARGET_MAX] = {0};
+        BuildTarget *target = &targets[t];
+        target_collect(target, t, seen);
+        if (target->kind == TARGET_SHARED) {
+            target->pic = true;
+            for (unsigned int i = 0; i < target->closure_count; i++) targets[target->closure[i]].pic = true;
+        }
+        for (unsigned int i = 0; i < target->closure_count / 2; i++) {
+            unsigned int swap = target->closure[i];
+            target->closure[i] = target->closure[target->closure_count - 1 - i];
+            target->closure[target->closure_count - 1 - i] = swap;
+        }
+    }
+    if (!ok) {
+        targets_free(targets, total);
+        return NULL;
+    }
+    *count = total;
+    return targets;
+} // }}}
+struct LinkerSelection {
+    const char *compilers[4]; // Compilers whose linker has been chosen
+    const char *linkers[4];   // Linker chosen for each compiler, NULL for its default
+    unsigned int count;       // Number of compilers looked up
+} g_linkers;
+
+bool linker_accepted(const char *compiler, const char *linker)
+{ // {{{
+    // Links an empty shared object with -fuse-ld=, compilers that don't know
+    // the linker fail here, such as gcc before 12.1 with mold
+    char output[PATH_MAX];
+    const char *tmp = getenv("TMPDIR");
+    snprintf(output, sizeof(output), "%s/build-ld-probe-%d.so", tmp != NULL ? tmp : "/tmp", (int)getpid());
+    Cmd cmd = {0};
+    cmd_append(&cmd, compiler);
+    cmd_append_fmt(&cmd, "-fuse-ld=%s", linker);
+    cmd_append(&cmd, "-shared");
+    cmd_append(&cmd, "-nostdlib");
+    cmd_append(&cmd, "-x");
+    cmd_append(&cmd, "c");
+    cmd_append(&cmd, "/dev/null");
+    cmd_append(&cmd, "-o");
+    cmd_append(&cmd, output);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    bool ok = spawn_and_wait(&cmd, &actions, NULL) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    cmd_free(&cmd);
+    unlink(output);
+    return ok;
+} // }}}
+const char *linker_select(const config_t *config, const char *compiler)
+{ // {{{
+    // The first linker of the list whose ld.NAME is on PATH, which is where
+    // -fuse-ld= finds it, and that the compiler accepts. Looked up once per
+    // build and compiler
+    struct LinkerSelection *selected = &g_linkers;
+    for (unsigned int i = 0; i < selected->count; i++) {
+        if (strcmp(selected->compilers[i], compiler) == 0) return selected->linkers[i];
+    }
+    const char *linker = NULL;
+    for (unsigned int i = 0; linker == NULL && config->linkers != NULL && config->linkers[i] != NULL; i++) {
+        char program[NAME_MAX];
+        snprintf(program, sizeof(program), "ld.%s", config->linkers[i]);
+        if (!program_on_path(program)) continue;
+        if (linker_accepted(compiler, config->linkers[i])) {
+            linker = config->linkers[i];
+        } else {
+            print("INF", "1", "%s doesn't accept -fuse-ld=%s, trying the next linker\n", compiler, config->linkers[i]);
+        }
+    }
+    if (selected->count < sizeof(selected->compilers) / sizeof(selected->compilers[0])) {
+        selected->compilers[selected->count] = compiler;
+        selected->linkers[selected->count++] = linker;
+    }
+    return linker;
+} // }}}
+int make_link(const config_t *config, const BuildTarget *target, Cmd *cmd)
+{ // {{{
+    // Every target is linked by this step, a static archive with ar and an
+    // executable or shared object with the compiler of its sources
+    const BuildTarget *targets = target->targets;
+    if (target->kind == TARGET_STATIC) {
+        cmd_append(cmd, "ar");
+        cmd_append(cmd, config->thin_archives ? "rcsT" : "rcs");
+        cmd_append(cmd, target->output);
+        for (unsigned int i = 0; i < target->file_count; i++) {
+            cmd_append(cmd, target->files[i].obj);
+        }
+        return 0;
+    }
+    bool cpp = target->cpp, shared = false;
+    for (unsigned int i = 0; i < target->closure_count; i++) {
+        cpp = cpp || targets[target->closure[i]].cpp;
+        shared = shared || targets[target->closure[i]].kind == TARGET_SHARED;
+    }
+    const char *compiler = cpp ? config->cc.cpp : config->cc.c;
+    cmd_append(cmd, compiler);
+    if (target->kind == TARGET_SHARED) {
+        // Users then record the bare name and find it through their $ORIGIN
+        // rpath instead of the path the library was linked from
+        cmd_append(cmd, "-shared");
+        cmd_append_fmt(cmd, "-Wl,-soname,%s", target->name);
+    }
+    const char *linker = linker_select(config, compiler);
+    if (linker != NULL) {
+        cmd_append_fmt(cmd, "-fuse-ld=%s", linker);
+        // Only with a linker from the list, the default BFD linker can't write the index
+        if (config->split_dwarf) cmd_append(cmd, "-Wl,--gdb-index");
+    }
+    cmd_append(cmd, "-o");
+    cmd_append(cmd, target->output);
+    for (unsigned int i = 0; i < target->file_count; i++) {
+        cmd_append(cmd, target->files[i].obj);
+    }
+    for (unsigned int i = 0; i < target->closure_count; i++) {
+        cmd_append(cmd, targets[target->closure[i]].output);
+    }
+    if (shared) cmd_append(cmd, "-Wl,-rpath,$ORIGIN"); // Shared objects are found next to the output
+    append_strings(cmd, config->flags);
+    append_strings(cmd, config->incs);
+    append_strings(cmd, config->lib_incs);
+    append_strings(cmd, config->libs);
+    return 0;
+} // }}}
+uint64_t link_inputs_hash(const BuildTarget *target, bool *hashed)
+{ // {{{
+    // Combined hash of the contents of every object and library on the link
+    // line, 0 when one of them is missing. Outputs from a build database that
+    // predates the hashes are hashed here once
+    uint64_t h = hash_string(target->name, 0);
+    for (unsigned int i = 0; i < target->file_count + target->closure_count; i++) {
+        uint32_t id = i < target->file_count
+            ? target->files[i].id : target->targets[target->closure[i - target->file_count]].id;
+        FileRecord *record = &build_db.files[id];
+        if (record->hash == 0 && hash_file(record->path, 0, &record->hash) && hashed != NULL) {
+            *hashed = true;
+        }
+        if (record->hash == 0) return 0;
+        h = hash_combine(h, record->hash);
+    }
+    return h;
+} // }}}
+bool link_up_to_date(const BuildTarget *target, uint64_t inputs)
+{ // {{{
+    const FileRecord *record = &build_db.files[target->id];
+    StatEntry output_stat;
+    return inputs != 0 && record->input_hash == inputs
+        && record->cmd_hash == hash_cmd(&target->cmd)
+        && stat_cache_get(target->output, &output_stat);
+} // }}}
+void target_schedule(const BuildTarget targets[], unsigned int t, bool seen[], unsigned int order[], unsigned int *count)
+{ // {{{
+    // Post order over the links, so every library comes before its users
+    seen[t] = true;
+    for (unsigned int i = 0; i < targets[t].link_count; i++) {
+        if (!seen[targets[t].links[i]]) target_schedule(targets, targets[t].links[i], seen, order, count);
+    }
+    order[(*count)++] = t;
+} // }}}
+int link_target(Job *job)
+{ // {{{
+    // Runs once the objects and libraries of the target are ready. A target
+    // whose inputs came out the same as when it was last linked is left alone
+    BuildTarget *target = job->target;
+    if (job->input_failed) {
+        return 1; // The failed input was reported already
+    }
+    uint64_t inputs = link_inputs_hash(target, NULL);
+    if (link_up_to_date(target, inputs)) {
+        job->cut_off = true;
+        return 0;
+    }
+    if (target->kind == TARGET_STATIC) {
+        unlink(target->output); // ar only adds members, objects of removed sources would stay
+    }
+    int status = build_file(&target->cmd, &job->usage);
+    FileRecord *record = &build_db.files[target->id];
+    record->cmd_hash = status == 0 ? hash_cmd(&target->cmd) : 0;
+    record->input_hash = status == 0 ? inputs : 0;
+    if (status == 0 && target->kind == TARGET_STATIC) {
+        // A thin archive only names its members, so their contents stand in for it
+        record->hash = inputs;
+    } else if (status != 0 || !hash_file(target->output, 0, &record->hash)) {
+        record->hash = 0;
+    }
+    return status;
+} // }}}
+
+// Build functions
+void job_report(JobQueue *queue, Job *job)
+{ // {{{
+    // Written in one go under the print mutex so the output of parallel jobs
+    // never interleaves, a quiet successful job only advances the progress
+    // line which a terminal keeps overwriting
+    pthread_mutex_lock(&g_thread_print_mutex);
+    unsigned int finished = ++queue->reported;
+    if ((job->status != 0 && !job->input_failed) || job->output.size > 0) {
+        char *line = cmd_render(job->cmd);
+        print_section(job->status == 0 ? "DONE" : "FAIL", job->status == 0 ? "32" : "31");
+        printf("%s\n", line != NULL ? line : job->cmd->argv[0]);
+        free(line);
+        fflush(stdout);
+        fwrite(job->output.data, 1, job->output.size, stderr);
+        if (job->status != 0) fprintf(stderr, "Error: %s failed with status %d\n", job->name, job->status);
+        fflush(stderr);
+    }
+    char progress[32];
+    snprintf(progress, sizeof(progress), "%u/%u", finished, queue->tail);
+    print_section(progress, job->status == 0 ? "32" : "31");
+    const char *note = job->input_failed ? " (skipped)" : job->cached ? " (cached)"
+        : job->target == NULL ? "" : job->cut_off ? " (unchanged)" : "";
+    printf("%s%s", job->name, note);
+    if (isatty(1) == 1) {
+        g_progress_shown = true;
+    } else {
+        printf("\n");
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&g_thread_print_mutex);
+    free(job->output.data);
+    job->output = (JobOutput){ .fd = -1 };
+} // }}}
+void job_hash_object(Job *job)
+{ // {{{
+    // Hashed as soon as it is written so the link waiting for the object can
+    // tell whether it changed
+    FileRecord *record = &build_db.files[job->id];
+    uint64_t previous = record->hash;
+    if (job->status != 0 || !hash_file(record->path, 0, &record->hash)) {
+        record->hash = 0;
+    } else if (previous != 0 && record->hash == previous) {
+        job->cut_off = true;
+    }
+} // }}}
+void *job_worker(void *arg)
+{ // {{{
+    const Worker *worker = (const Worker *)arg;
+    JobQueue *queue = worker->queue;
+    Job *job;
+    while ((job = job_queue_pop(queue)) != NULL) {
+        // Under a jobserver the pool only sets how many jobs may wait for a token
+        JobToken token = jobserver_acquire();
+        job->slot = worker->slot;
+        job->start_ms = now_ms();
+        job->output = (JobOutput){ .fd = -1 };
+        t_job_output = &job->output;
+        if (job->target != NULL) {
+            job->status = link_target(job);
+        } else if (job->input_failed) {
+            job->status = 1; // The failed precompiled header was reported already
+        } else if (job->source->is_pch) {
+            job->status = build_file(job->cmd, &job->usage);
+        } else {
+            // The cache only holds the object and .d file, not a .dwo file
+            job->status = c_config.cache.dir != NULL && !c_config.split_dwarf
+                ? compile_cached(job->source, &job->usage, &job->cached)
+                : compile_source(job->source, &job->usage);
+            job_hash_object(job);
+        }
+        t_job_output = NULL;
+        job->end_ms = now_ms();
+        jobserver_release(token);
+        job_queue_finish(queue, job);
+        job_report(queue, job);
+    }
+    return NULL;
+} // }}}
+bool source_check(SourceFile *source, unsigned int *commands_changed)
+{ // {{{
+    // The object is up to date when it was built by exactly this command
+    // and the fingerprint of its source and every header recorded from its
+    // last .d file matches the last build
+    FileRecord *record = build_db_find(&build_db, source->obj, true);
+    if (record == NULL) return false;
+    record->used = true;
+    source->id = record - build_db.files;
+    const uint64_t cmd_hash = hash_cmd(&source->cmd);
+    if (record->cmd_hash != 0 && record->cmd_hash != cmd_hash) {
+        (*commands_changed)++;
+    }
+    StatEntry obj_stat;
+    source->dirty = record->cmd_hash != cmd_hash
+        || record->input_hash == 0
+        || record->dep_count == 0
+        || !stat_cache_get(source->obj, &obj_stat)
+        || fingerprint_inputs(&build_db, source->id) != record->input_hash;
+    return true;
+} // }}}
+bool pch_write_header(const char *path, const char *const *headers)
+{ // {{{
+    // Includes every configured header, only rewritten when the list changed
+    // so the PCH isn't rebuilt for nothing
+    char *content = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&content, &size);
+    if (fp == NULL) return false;
+    fprintf(fp, "// Generated from the pch section of %s, do not edit\n", build.file);
+    for (unsigned int i = 0; headers[i] != NULL; i++) {
+        char resolved[PATH_MAX];
+        if (headers[i][0] == '<') {
+            fprintf(fp, "#include %s\n", headers[i]);
+        } else {
+            // Made absolute since the generated header lives in the output directory
+            fprintf(fp, "#include \"%s\"\n", realpath(headers[i], resolved) != NULL ? resolved : headers[i]);
+        }
+    }
+    fclose(fp);
+    bool ok = write_if_changed(path, content, size);
+    free(content);
+    return ok;
+} // }}}
+#define PCH_COUNT 4 // C and C++, each for sources built without and with -fPIC
+
+int make_pch(const config_t *config, const InternalConfig *internal_config,
+        const BuildTarget targets[], unsigned int target_count, SourceFile pchs[PCH_COUNT])
+{ // {{{
+    // Sets up one precompiled header per language and position independence
+    // that has sources and pch headers, pchs[cpp + 2 * pic]. A PCH is
+    // rejected by a source built with other -fPIC settings. Sources include
+    // the generated header with -include, and gcc picks up header.gch while
+    // clang picks up header.pch next to it
+    unsigned int commands_changed = 0;
+    for (int n = 0; n < PCH_COUNT; n++) {
+        const int cpp = n % 2, pic = n / 2;
+        const char *const *headers = cpp ? config->pch.cpp : config->pch.c;
+        if (headers == NULL || headers[0] == NULL) continue;
+        bool used = false;
+        for (unsigned int t = 0; t < target_count && !used; t++) {
+            if (targets[t].pic != (pic == 1)) continue;
+            const PathList *src = &targets[t].sources;
+            for (unsigned int i = 0; i < src->count && !used; i++) {
+                const char *extension = strrchr(src->paths[i], '.');
+                used = (extension != NULL && strstr(extension, "cpp") != NULL) == (cpp == 1);
+            }
+        }
+        if (!used) continue;
+
+        const char *compiler = cpp ? config->cc.cpp : config->cc.c;
+        const char *lang = cpp ? (pic ? "cpp_pic" : "cpp") : (pic ? "c_pic" : "c");
+        bool clang = false;
+        compiler_identity(compiler, &clang);
+        char dir[PATH_MAX], header[PATH_MAX], obj[PATH_MAX], dep[PATH_MAX];
+        if (snprintf(dir, sizeof(dir), "%s/pch", internal_config->out_dir) >= (int)sizeof(dir)
+                || snprintf(header, sizeof(header), "%s/pch_%s.h", dir, lang) >= (int)sizeof(header)
+                || snprintf(obj, sizeof(obj), "%s.%s", header, clang ? "pch" : "gch") >= (int)sizeof(obj)
+                || snprintf(dep, sizeof(dep), "%s/pch_%s.d", dir, lang) >= (int)sizeof(dep)) {
+            fprintf(stderr, "Error: Output path for the precompiled header is too long\n");
+            return -1;
+        }
+        recursive_mkdir(dir);
+        if (!pch_write_header(header, headers)) return -1;
+
+        SourceFile *pch = &pchs[n];
+        pch->is_pch = true;
+        pch->src = strdup(header);
+        pch->obj = strdup(obj);
+        pch->dep = strdup(dep);
+        if (pch->src == NULL || pch->obj == NULL || pch->dep == NULL) {
+            fprintf(stderr, "Error: Failed to allocate paths for %s\n", header);
+            return -1;
+        }
+        // Built with the flags of the sources, a PCH built with other flags is rejected
+        cmd_append(&pch->cmd, compiler);
+        cmd_append(&pch->cmd, "-x");
+        cmd_append(&pch->cmd, cpp ? "c++-header" : "c-header");
+        cmd_append(&pch->cmd, header);
+        cmd_append(&pch->cmd, "-o");
+        cmd_append(&pch->cmd, obj);
+        append_strings(&pch->cmd, config->flags);
+        append_strings(&pch->cmd, config->incs);
+        if (config->split_dwarf) cmd_append(&pch->cmd, "-gsplit-dwarf");
+        if (pic) cmd_append(&pch->cmd, "-fPIC");
+        cmd_append(&pch->cmd, "-MF");
+        cmd_append(&pch->cmd, dep);
+        if (!source_check(pch, &commands_changed)) return -1;
+    }
+    return 0;
+} // }}}
+int make_targets(const config_t *config, BuildTarget *target, SourceFile pchs[PCH_COUNT], unsigned int *commands_changed)
+{ // {{{
+    for (unsigned int i = 0; i < target->file_count; i++) {
+        SourceFile *source = &target->files[i];
+        Cmd *const cmd = &source->cmd;
+        char dir[PATH_MAX], filename[PATH_MAX];
+        source->src = target->sources.paths[i];
+
+        // Strip the extension and get the directory and filename
+        strip_extension(source->src, filename, PATH_MAX);
+        get_filename_without_path(filename, filename, sizeof(filename));
+        get_path_without_filename(source->src, dir, sizeof(dir));
+
+        // A unity batch already lives in the object directory and keeps its object next to it
+        size_t obj_dir_len = strlen(target->obj_dir);
+        bool generated = strncmp(source->src, target->obj_dir, obj_dir_len) == 0 && source->src[obj_dir_len] == '/';
+        char full_dir[PATH_MAX], obj[PATH_MAX], dep[PATH_MAX];
+        int dir_len = generated
+            ? snprintf(full_dir, sizeof(full_dir), "%s", dir)
+            : snprintf(full_dir, sizeof(full_dir), "%s/%s", target->obj_dir, dir);
+        if (dir_len >= (int)sizeof(full_dir)
+                || snprintf(obj, sizeof(obj), "%s/%s.o", full_dir, filename) >= (int)sizeof(obj)
+                || snprintf(dep, sizeof(dep), "%s/%s.d", full_dir, filename) >= (int)sizeof(dep)) {
+            fprintf(stderr, "Error: Output path for %s is too long\n", source->src);
+            return -1;
+        }
+        source->obj = strdup(obj);
+        source->dep = strdup(dep);
+        if (source->obj == NULL || source->dep == NULL) {
+            fprintf(stderr, "Error: Failed to allocate paths for %s\n", source->src);
+            return -1;
+        }
+
+        // Create the command to compile the source file
+        const char *compiler = config->cc.c;
+        const char *extension = strrchr(source->src, '.');
+        bool cpp = extension != NULL && strstr(extension, "cpp") != NULL;
+        if (cpp) {
+            target->cpp = true;
+            compiler = config->cc.cpp;
+        }
+        cmd_append(cmd, compiler);
+        cmd_append(cmd, "-c");
+        cmd_append(cmd, source->src);
+        cmd_append(cmd, "-o");
+        cmd_append(cmd, source->obj);
+        append_strings(cmd, config->flags);
+        append_strings(cmd, config->incs);
+        if (config->split_dwarf) cmd_append(cmd, "-gsplit-dwarf");
+        if (target->pic) cmd_append(cmd, "-fPIC");
+        SourceFile *pch = &pchs[cpp + 2 * target->pic];
+        if (pch->src != NULL) {
+            source->pch = pch;
+            cmd_append(cmd, "-include");
+            cmd_append(cmd, pch->src);
+        }
+
+        if (!source_check(source, commands_changed)) return -1;
+
+        // Create the output directory if it doesn't exist
+        if (source->dirty) {
+            recursive_mkdir(full_dir);
+        }
+    }
+    return 0;
+} // }}}
+int make_build(const BuildMode mode, Cmd *cmd)
+{ // {{{
+    if (build.cc == NULL || build.file == NULL || build.exe == NULL) {
+        fprintf(stderr, "Error: Build configuration is incomplete\n");
+        return -1;
+    }
+    // The caller names the output, so the command only depends on the mode
+    cmd_append(cmd, build.cc);
+    cmd_append(cmd, build.file);
+    switch (mode) {
+        case MODE_REL:
+            append_strings(cmd, (const char *[]){"-O2", "-lpthread", NULL});
+            break;
+        case MODE_DEV:
+            append_strings(cmd, (const char *[]){"-Wall", "-DDEBUG", "-g", "-lpthread", NULL});
+            break;
+        case MODE_NONE:
+            append_strings(cmd, (const char *[]){"-Wall", "-lpthread", NULL});
+            break;
+        default:
+            fprintf(stderr, "Error: Invalid build mode\n");
+            return -1;
+    }
+    return 0;
+} // }}}
+
+// Compile function
+void prune_build_executables(const char *dir, const char *name, const char *keep)
+{ // {{{
+    // Only the newest build executable of a mode is kept
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    const size_t len = strlen(name);
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, name, len) != 0 || entry->d_name[len] != '-') continue;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) continue;
+        if (strcmp(path, keep) != 0) unlink(path);
+    }
+    closedir(d);
+} // }}}
+bool install_build_executable(const char *exe)
+{ // {{{
+    // Points build.exe at the newest build executable so the next run in the
+    // same mode starts straight away, a hard link keeps it executable
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", build.exe, (int)getpid()) >= (int)sizeof(tmp)) return false;
+    unlink(tmp);
+    bool ok = link(exe, tmp) == 0
+        || (copy_file(exe, tmp) && chmod(tmp, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == 0);
+    if (!ok || rename(tmp, build.exe) != 0) {
+        fprintf(stderr, "Error: Failed to install %s as %s\n", exe, build.exe);
+        unlink(tmp);
+        return false;
+    }
+    return true;
+} // }}}
+int compile_build_file(char const *const argv[], const InternalConfig *conf)
+{ // {{{
+    // Every mode has its own build executable in its output tree, named by a
+    // key over build.c and the command that compiles it. When this process
+    // isn't the executable for the key it is replaced by it, which is only
+    // compiled when it doesn't exist yet
+    Cmd build_file_cmd = {0};
+    uint64_t file_hash = 0;
+    if (make_build(conf->mode, &build_file_cmd) != 0 || !hash_file(build.file, 0, &file_hash)) {
+        fprintf(stderr, "Error: make_build failed\n");
+        cmd_free(&build_file_cmd);
+        return -1;
+    }
+    const uint64_t key = hash_combine(file_hash, hash_cmd(&build_file_cmd));
+    if (key == BUILD_SELF_KEY) {
+        cmd_free(&build_file_cmd);
+        return 0; // Already running the build executable of build.c and the mode
+    }
+
+    char name[PATH_MAX], exe[PATH_MAX];
+    get_filename_without_path(build.exe, name, sizeof(name));
+    char tmp[PATH_MAX];
+    if (snprintf(exe, sizeof(exe), "%s/%s-%016llx", conf->out_dir, name, (unsigned long long)key) >= (int)sizeof(exe)
+            || snprintf(tmp, sizeof(tmp), "%s.tmp", exe) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Error: Build executable path in %s is too long\n", conf->out_dir);
+        cmd_free(&build_file_cmd);
+        return -1;
+    }
+    if (access(exe, X_OK) != 0) {
+        // Compiled under a temporary name so a failed compile never leaves a
+        // broken executable behind for the key
+        cmd_append_fmt(&build_file_cmd, "-DBUILD_SELF_KEY=0x%016llxULL", (unsigned long long)key);
+        cmd_append(&build_file_cmd, "-o");
+        cmd_append(&build_file_cmd, tmp);
+
+        struct rusage usage = {0};
+        double rebuild_start = now_ms();
+        int status = exec_rusage(&build_file_cmd, &usage);
+        trace_process(TRACE_COMPILE, build.file, rebuild_start, now_ms(), -1, status, &usage);
+        trace_phase("self-rebuild", rebuild_start);
+        if (status != 0 || rename(tmp, exe) != 0) {
+            fprintf(stderr, "Error: Failed to build the build file\n");
+            unlink(tmp);
+            cmd_free(&build_file_cmd);
+            return -1;
+        }
+        prune_build_executables(conf->out_dir, name, exe);
+        install_build_executable(exe);
+    }
+    cmd_free(&build_file_cmd);
+
+    // Replace this process rather than waiting on a child, argv is passed on
+    // untouched and the trace is continued by the new executable
+    trace_flush();
+    jobserver_shutdown();
+    if (g_trace.enabled) setenv(TRACE_ENV, "1", 1);
+    execv(exe, (char *const *)argv);
+    unsetenv(TRACE_ENV);
+    fprintf(stderr, "Error: Failed to run %s: %s\n", exe, strerror(errno));
+    return -1;
+} // }}}
+int compile_files(const config_t *config, const InternalConfig *internal_config,
+        BuildTarget targets[], unsigned int target_count, int *linked, double *link_ms)
+{ // {{{
+    // Compiles the sources of every target and links the targets in one pool,
+    // a link starts as soon as its objects and the libraries it links are
+    // done. Returns the number of sources compiled and sets the number of
+    // targets linked and the time their links took
+
+    // Allocate memory for build commands, the precompiled headers of C and
+    // C++ follow the sources of every target
+    unsigned int size = 0;
+    for (unsigned int t = 0; t < target_count; t++) size += targets[t].sources.count;
+    const unsigned int total = size + PCH_COUNT;
+    SourceFile *sources = calloc(total, sizeof(SourceFile));
+    if (sources == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the build commands\n");
+        return -1;
+    }
+    SourceFile *pchs = &sources[size];
+
+    // Create the build commands for each source file and each target, their
+    // arguments and the edges of the job graph live in one arena
+    Arena arena = {0};
+    for (unsigned int i = 0; i < total; i++) sources[i].cmd.arena = &arena;
+    for (unsigned int t = 0; t < target_count; t++) targets[t].cmd.arena = &arena;
+    double scan_start = now_ms();
+    unsigned int commands_changed = 0;
+    bool ok = make_pch(config, internal_config, targets, target_count, pchs) == 0;
+    for (unsigned int t = 0, offset = 0; t < target_count && ok; t++) {
+        targets[t].files = &sources[offset];
+        targets[t].file_count = targets[t].sources.count;
+        offset += targets[t].file_count;
+        ok = make_targets(config, &targets[t], pchs, &commands_changed) == 0;
+    }
+    for (unsigned int t = 0; t < target_count && ok; t++) {
+        FileRecord *record = NULL;
+        ok = make_link(config, &targets[t], &targets[t].cmd) == 0
+            && (record = build_db_find(&build_db, targets[t].output, true)) != NULL;
+        if (ok) {
+            record->used = true;
+            targets[t].id = record - build_db.files;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: make_build_targets failed\n");
+        source_files_free(sources, total);
+        arena_free(&arena);
+        return -1;
+    }
+    if (commands_changed > 0) {
+        print("INF", "1", "Recompiling %u sources whose compile command changed\n", commands_changed);
+    }
+    trace_phase("dependency scan", scan_start);
+    if (internal_config->stats) {
+        print("STAT", "35", "Dependency scan: %.3f ms for %u sources and %u files\n",
+                now_ms() - scan_start, size, build_db.file_count);
+        print("STAT", "35", "Stat cache: %lu hits, %lu misses\n",
+                atomic_load(&g_stat_cache.hits), atomic_load(&g_stat_cache.misses));
+    }
+
+    // Queue a job for every source file that needs to be rebuilt
+    const unsigned int capacity = total + target_count;
+    JobQueue queue;
+    if (!job_queue_init(&queue, capacity)) {
+        source_files_free(sources, total);
+        arena_free(&arena);
+        return -1;
+    }
+    queue.max_load = internal_config->max_load;
+    // Compiles sent to workers use their memory, so only an explicit budget applies then
+    remote_init(config);
+    queue.mem_budget_kb = internal_config->mem_budget_mb > 0
+        ? (uint64_t)internal_config->mem_budget_mb * 1024 : g_remote.count > 0 ? 0 : mem_available_kb();
+    Job jobs[capacity];
+    Job *order[capacity];
+    Job *source_jobs[total];
+    Job *link_jobs[target_count];
+    int files_built = 0;
+    unsigned int job_count = 0;
+    for (unsigned int i = 0; i < total; i++) source_jobs[i] = NULL;
+    for (unsigned int t = 0; t < target_count; t++) link_jobs[t] = NULL;
+    for (unsigned int n = 0; n < total && ok; n++) {
+        // The precompiled headers are queued first so the sources can wait for them
+        unsigned int i = n < PCH_COUNT ? size + n : n - PCH_COUNT;
+        if (!sources[i].dirty) {
+            continue;
+        }
+        Job *job = &jobs[job_count++];
+        *job = (Job){ .cmd = &sources[i].cmd, .source = &sources[i], .name = sources[i].src,
+            .id = sources[i].id, .index = i };
+        if (sources[i].pch != NULL && source_jobs[sources[i].pch - sources] != NULL) {
+            ok = job_wait_for(job, source_jobs[sources[i].pch - sources], &arena);
+        }
+        source_jobs[i] = job;
+        files_built++;
+    }
+
+    // A target is linked after its objects and libraries when one of them is
+    // rebuilt, or when it isn't what it was last linked from. Libraries come
+    // first so a target can wait for the link of each one it uses
+    unsigned int schedule[TARGET_MAX], scheduled = 0;
+    bool seen[TARGET_MAX] = {0};
+    for (unsigned int t = 0; t < target_count; t++) {
+        if (!seen[t]) target_schedule(targets, t, seen, schedule, &scheduled);
+    }
+    for (unsigned int n = 0; n < scheduled && ok; n++) {
+        BuildTarget *target = &targets[schedule[n]];
+        bool hashed = false, rebuilt = false;
+        uint64_t inputs = link_inputs_hash(target, &hashed);
+        if (hashed) build_db.modified = true;
+        for (unsigned int i = 0; i < target->file_count; i++) {
+            rebuilt = rebuilt || target->files[i].dirty;
+        }
+        for (unsigned int i = 0; i < target->closure_count; i++) {
+            rebuilt = rebuilt || link_jobs[target->closure[i]] != NULL;
+        }
+        if (!rebuilt && link_up_to_date(target, inputs)) continue;
+        const FileRecord *record = &build_db.files[target->id];
+        if (!rebuilt && inputs != 0 && record->input_hash == inputs
+                && record->cmd_hash != 0 && record->cmd_hash != hash_cmd(&target->cmd)) {
+            print("INF", "1", "Relinking %s because its link command changed\n", target->name);
+        }
+
+        Job *job = &jobs[job_count++];
+        *job = (Job){ .cmd = &target->cmd, .target = target, .name = target->name,
+            .id = target->id, .index = total + schedule[n] };
+        for (unsigned int i = 0; i < target->file_count && ok; i++) {
+            Job *compile = source_jobs[&target->files[i] - sources];
+            if (compile != NULL) ok = job_wait_for(job, compile, &arena);
+        }
+        for (unsigned int i = 0; i < target->closure_count && ok; i++) {
+            Job *library = link_jobs[target->closure[i]];
+            if (library != NULL) ok = job_wait_for(job, library, &arena);
+        }
+        link_jobs[schedule[n]] = job;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to allocate the job graph\n");
+        job_queue_destroy(&queue);
+        source_files_free(sources, total);
+        arena_free(&arena);
+        return -1;
+    }
+
+    // Translation units don't depend on each other, so the critical path is
+    // the longest job and starting the longest jobs first keeps one slow
+    // source from finishing alone at the end of the build. Precompiled
+    // headers and links are queued ahead of the compiles, they only start
+    // once the jobs they wait for are done
+    int worker_count = internal_config->thread_count;
+    if (worker_count > (int)job_count) worker_count = job_count;
+    for (unsigned int i = 0; i < job_count; i++) order[i] = &jobs[i];
+    unsigned int known = estimate_job_costs(order, job_count);
+    qsort(order, job_count, sizeof(Job *), compare_jobs_by_cost);
+    double predicted_ms = predict_makespan(order, job_count, worker_count);
+    for (unsigned int i = 0; i < job_count; i++) {
+        job_queue_push(&queue, order[i]);
+    }
+    job_queue_close(&queue);
+
+    // Run the jobs on a fixed pool of workers, or on this thread when threading is disabled
+    double compile_start = now_ms();
+    Worker inline_worker = { .queue = &queue, .slot = 0 };
+    if (worker_count > 0) {
+        pthread_t threads[worker_count];
+        Worker workers[worker_count];
+        int started = 0;
+        for (; started < worker_count; started++) {
+            workers[started] = (Worker){ .queue = &queue, .slot = started };
+            if (pthread_create(&threads[started], NULL, job_worker, &workers[started]) != 0) {
+                fprintf(stderr, "Error: pthread_create failed\n");
+                break;
+            }
+        }
+        if (started == 0) job_worker(&inline_worker);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    } else {
+        job_worker(&inline_worker);
+    }
+    double compile_end = compile_start;
+    for (unsigned int i = 0; i < job_count; i++) {
+        if (jobs[i].target == NULL && jobs[i].end_ms > compile_end) compile_end = jobs[i].end_ms;
+    }
+    print_progress_end();
+    if (job_count > 0) trace_phase("compile", compile_start);
+    for (unsigned int i = 0; i < job_count; i++) {
+        trace_process(jobs[i].target != NULL ? TRACE_LINK : TRACE_COMPILE, jobs[i].name,
+                jobs[i].start_ms, jobs[i].end_ms, jobs[i].slot, jobs[i].status, &jobs[i].usage);
+    }
+
+    // Only the .d files of recompiled sources are parsed to update the
+    // dependency graph and record the fingerprint they were built from. The
+    // objects were hashed as they finished, a recompile that produced the
+    // same bytes, such as after a comment edit, doesn't relink
+    unsigned int cut_off = 0, compile_failed = 0, link_failed = 0;
+    *linked = 0;
+    *link_ms = 0;
+    for (unsigned int i = 0; i < job_count; i++) {
+        FileRecord *record = &build_db.files[jobs[i].id];
+        // Rounded up so a fast job is still told apart from no history
+        double duration_ms = jobs[i].end_ms - jobs[i].start_ms;
+        build_db.modified = true;
+        if (jobs[i].target != NULL) {
+            stat_cache_invalidate(jobs[i].target->output);
+            if (jobs[i].status != 0 && !jobs[i].input_failed) link_failed++;
+            if (jobs[i].status != 0 || jobs[i].cut_off) continue;
+            (*linked)++;
+            *link_ms += duration_ms;
+            record->duration_ms = (uint32_t)duration_ms + 1;
+            if (jobs[i].usage.ru_maxrss > 0) record->peak_rss_kb = (uint32_t)jobs[i].usage.ru_maxrss;
+            continue;
+        }
+        SourceFile *source = jobs[i].source;
+        stat_cache_invalidate(source->obj);
+        record->input_hash = 0;
+        record->cmd_hash = 0;
+        if (jobs[i].status != 0 && !jobs[i].input_failed) compile_failed++;
+        if (jobs[i].cut_off) cut_off++;
+        PathList deps = {0};
+        // gcc leaves the headers of a precompiled header out of the .d file
+        // of a source compiled with it, so they are taken from its own
+        if (jobs[i].status == 0
+                && parse_dependencies(source->dep, &deps)
+                && (source->pch == NULL || parse_dependencies(source->pch->dep, &deps))
+                && build_db_set_deps(&build_db, source->id, source->src, &deps)) {
+            record = &build_db.files[source->id];
+            record->input_hash = fingerprint_inputs(&build_db, source->id);
+            record->cmd_hash = hash_cmd(&source->cmd);
+        }
+        // wait4 reports the largest of the compiler driver and the processes
+        // it waited for. A cache hit ran no compiler and keeps the last time
+        // and memory, a copy that took a few ms would misorder the queue
+        if (!jobs[i].cached) {
+            record->duration_ms = jobs[i].status == 0 ? (uint32_t)duration_ms + 1 : 0;
+        }
+        if (jobs[i].status != 0) {
+            record->peak_rss_kb = 0;
+        } else if (jobs[i].usage.ru_maxrss > 0) {
+            record->peak_rss_kb = (uint32_t)jobs[i].usage.ru_maxrss;
+        }
+        path_list_free(&deps);
+    }
+    if (cut_off > 0) {
+        print("INF", "1", "Early cutoff: %u of %d recompiled objects are unchanged\n", cut_off, files_built);
+    }
+
+    if (files_built > 1 && known > 0) {
+        print("INF", "1", "Compiled %d sources in %.0f ms, predicted %.0f ms from %u timed sources\n",
+                files_built, compile_end - compile_start, predicted_ms, known);
+    }
+    if (queue.delayed > 0) {
+        print("INF", "1", "Waited %u times for the load or memory limit before starting a compile\n", queue.delayed);
+    }
+    if (g_remote.count > 0 && files_built > 0) {
+        print("INF", "1", "Workers: %u compiled remotely, %u compiled here after their worker failed\n",
+                atomic_load(&g_remote.remote), atomic_load(&g_remote.fallback));
+    }
+    if (internal_config->stats && job_count > 0 && queue.mem_budget_kb > 0) {
+        print("STAT", "35", "Memory budget: %lu MB\n", (unsigned long)(queue.mem_budget_kb / 1024));
+    }
+
+    if (config->cache.dir != NULL && files_built > 0) {
+        print("INF", "1", "Cache: %u hits, %u misses\n",
+                atomic_load(&g_object_cache.hits), atomic_load(&g_object_cache.misses));
+        if (atomic_load(&g_object_cache.stored) > 0) {
+            object_cache_evict(&config->cache);
+        }
+    }
+
+    job_queue_destroy(&queue);
+    source_files_free(sources, total);
+    for (unsigned int t = 0; t < target_count; t++) cmd_free(&targets[t].cmd);
+    arena_free(&arena);
+    if (compile_failed > 0) {
+        fprintf(stderr, "Error: %u of %d source files failed to compile\n", compile_failed, files_built);
+    }
+    if (link_failed > 0) {
+        fprintf(stderr, "Error: %u of %u targets failed to link\n", link_failed, target_count);
+    }
+    return compile_failed > 0 || link_failed > 0 ? -1 : files_built;
+} // }}}
+
+int build_target(const InternalConfig *conf, const char *db_file_path)
+{ // {{{
+    // Compiles and links every target then saves the build database, returns
+    // 1 when a target was linked, 0 when up to date and -1 on failure
+    double expand_start = now_ms();
+    g_dirs_listed = 0;
+    unsigned int target_count = 0, source_count = 0;
+    BuildTarget *targets = targets_init(&c_config, conf, &target_count);
+    if (targets == NULL) {
+        return -1;
+    }
+    for (unsigned int t = 0; t < target_count; t++) source_count += targets[t].sources.count;
+    trace_phase("source scan", expand_start);
+    if (conf->stats) {
+        print("STAT", "35", "Source scan: %.3f ms for %u sources of %u targets, %u directories listed again\n",
+                now_ms() - expand_start, source_count, target_count, g_dirs_listed);
+    }
+
+    int linked = 0;
+    double link_ms = 0;
+    int files_built = compile_files(&c_config, conf, targets, target_count, &linked, &link_ms);
+    targets_free(targets, target_count);
+    double save_start = now_ms();
+    serialize_build_db(db_file_path, &build_db);
+    trace_phase("save build state", save_start);
+    if (files_built < 0) {
+        return -1;
+    }
+    if (linked > 0) {
+        // Links are what is left once the compiles finished, so this is what a faster linker saves
+        const char *linker = linker_select(&c_config, c_config.cc.c);
+        double total_ms = now_ms() - expand_start;
+        print("INF", "1", "Linking took %.0f ms with %s, %.0f%% of the %.0f ms build\n", link_ms,
+                linker != NULL ? linker : "the default linker", total_ms > 0 ? 100 * link_ms / total_ms : 0, total_ms);
+    }
+    if (files_built == 0 && linked == 0) {
+        print("INF", "1", "No files were changed\n");
+    } else if (linked == 0) {
+        print("INF", "1", "Skipped linking, every recompiled object is unchanged\n");
+    }
+    return linked > 0 ? 1 : 0;
+} // }}}
+
+// Watch functions
+static const int WATCH_DEBOUNCE_MS = 100;
+static const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+static const uint32_t WATCH_LISTING_EVENTS = IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+
+typedef struct WatchedFile {
+    int wd;           // Watch descriptor of the directory holding the file
+    const char *name; // Name of the file inside the directory, empty when the listing of the directory is watched
+    const char *path; // Path of the file as the build database knows it
+} WatchedFile;
+
+typedef struct Watcher {
+    int fd;                     // inotify instance
+    Arena names;                // Names of the watched files
+    WatchedFile *files;         // Files whose changes trigger a rebuild
+    unsigned int count;         // Number of watched files
+    unsigned int capacity;      // Number of file slots allocated
+    bool *watched;              // Indexed by build database id, set once the file is watched
+    unsigned int watched_count; // Number of flags allocated
+} Watcher;
+
+bool watch_file(Watcher *watcher, const char *path)
+{ // {{{
+    // Directories are watched rather than files because editors often save
+    // by writing a new file and renaming it over the old one
+    FileRecord *record = build_db_find(&build_db, path, true);
+    if (record == NULL) return false;
+    const uint32_t id = record - build_db.files;
+    if (id < watcher->watched_count && watcher->watched[id]) return true;
+    if (id >= watcher->watched_count) {
+        unsigned int count = build_db.file_capacity > id ? build_db.file_capacity : id + 1;
+        bool *watched = realloc(watcher->watched, count * sizeof(bool));
+        if (watched == NULL) {
+            fprintf(stderr, "Error: Failed to grow the watched files\n");
+            return false;
+        }
+        memset(watched + watcher->watched_count, 0, (count - watcher->watched_count) * sizeof(bool));
+        watcher->watched = watched;
+        watcher->watched_count = count;
+    }
+    if (watcher->count == watcher->capacity) {
+        unsigned int capacity = watcher->capacity ? watcher->capacity * 2 : 64;
+        WatchedFile *files = realloc(watcher->files, capacity * sizeof(WatchedFile));
+        if (files == NULL) {
+            fprintf(stderr, "Error: Failed to grow the watched files\n");
+            return false;
+        }
+        watcher->files = files;
+        watcher->capacity = capacity;
+    }
+
+    char dir[PATH_MAX], name[PATH_MAX];
+    get_path_without_filename(record->path, dir, sizeof(dir));
+    get_filename_without_path(record->path, name, sizeof(name));
+    int wd = inotify_add_watch(watcher->fd, dir[0] != '\0' ? dir : ".", WATCH_EVENTS);
+    if (wd == -1) {
+        fprintf(stderr, "Error: Failed to watch %s: %s\n", record->path, strerror(errno));
+        return true; // A missing directory shouldn't stop the others from being watched
+    }
+    const char *interned = arena_strdup(&watcher->names, name);
+    if (interned == NULL) return false;
+    watcher->files[watcher->count++] = (WatchedFile){ .wd = wd, .name = interned, .path = record->path };
+    watcher->watched[id] = true;
+    return true;
+} // }}}
+bool watch_inputs(Watcher *watcher)
+{ // {{{
+    // Watches build.c, the configured sources of every target, every input
+    // recorded for an output and the listing of every directory a pattern in
+    // src was expanded from, new headers are picked up after each build
+    if (!watch_file(watcher, build.file)) return false;
+    for (int t = -1; t < 0 || (c_config.targets != NULL && c_config.targets[t].name != NULL); t++) {
+        const char *const *src = t < 0 ? c_config.src : c_config.targets[t].src;
+        for (unsigned int i = 0; src != NULL && src[i] != NULL; i++) {
+            if (is_glob_pattern(src[i])) continue;
+            if (!watch_file(watcher, src[i])) return false;
+        }
+    }
+    for (unsigned int i = 0; i < build_db.file_count; i++) {
+        if (!build_db.files[i].used) continue;
+        if (is_directory_record(&build_db.files[i])) {
+            // Sources found in it are inputs of their objects
+            if (!watch_file(watcher, build_db.files[i].path)) return false;
+            continue;
+        }
+        for (uint32_t d = 0; d < build_db.files[i].dep_count; d++) {
+            if (!watch_file(watcher, build_db.files[build_db.files[i].deps[d]].path)) return false;
+        }
+    }
+    return true;
+} // }}}
+int watch_read_events(Watcher *watcher, bool *build_file_changed)
+{ // {{{
+    // Drains the pending events without blocking and forgets the stat of
+    // every watched file they name, returns the number of changes or -1 on
+    // failure
+    int changes = 0;
+    for (;;) {
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(watcher->fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) continue;
+            if (len == -1 && errno == EAGAIN) return changes;
+            fprintf(stderr, "Error: Failed to read file changes: %s\n", strerror(errno));
+            return -1;
+        }
+        const struct inotify_event *event;
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            bool overflow = (event->mask & IN_Q_OVERFLOW) != 0;
+            if (!overflow && event->len == 0) continue;
+            for (unsigned int i = 0; i < watcher->count; i++) {
+                const WatchedFile *file = &watcher->files[i];
+                // Events were dropped when the queue overflowed, so anything may have changed
+                if (!overflow && file->wd != event->wd) continue;
+                if (!overflow && file->name[0] != '\0' && strcmp(file->name, event->name) != 0) continue;
+                // A listing only changes when a visible entry comes or goes
+                if (!overflow && file->name[0] == '\0'
+                        && ((event->mask & WATCH_LISTING_EVENTS) == 0 || event->name[0] == '.')) continue;
+                stat_cache_invalidate(file->path);
+                if (strcmp(file->path, build.file) == 0) *build_file_changed = true;
+                changes++;
+            }
+        }
+    }
+} // }}}
+int watch_wait(Watcher *watcher, bool *build_file_changed)
+{ // {{{
+    // Blocks until a watched file changes and then until no event arrived
+    // for WATCH_DEBOUNCE_MS so a save-all triggers a single rebuild, returns
+    // the number of changes or -1 on failure
+    struct pollfd pfd = { .fd = watcher->fd, .events = POLLIN };
+    int changes = 0;
+    for (;;) {
+        int ready = poll(&pfd, 1, changes > 0 ? WATCH_DEBOUNCE_MS : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Failed to wait for file changes: %s\n", strerror(errno));
+            return -1;
+        }
+        if (ready == 0) return changes;
+        int read_changes = watch_read_events(watcher, build_file_changed);
+        if (read_changes < 0) return -1;
+        changes += read_changes;
+    }
+} // }}}
+void watch_forget(Watcher *watcher)
+{ // {{{
+    // Drops the watched files so they are collected again, the directory
+    // watches stay in place and are handed out again by inotify
+    watcher->count = 0;
+    if (watcher->watched != NULL) memset(watcher->watched, 0, watcher->watched_count * sizeof(bool));
+} // }}}
+void build_state_reset()
+{ // {{{
+    // Prepares the in-memory state of the last build of a daemon or watch for
+    // the next one. Counters and lookups start over, a compiler or linker may
+    // have been installed since
+    object_cache_reset();
+    g_linkers.count = 0;
+    atomic_store(&g_stat_cache.hits, 0);
+    atomic_store(&g_stat_cache.misses, 0);
+
+    // Outputs aren't watched since the build writes them itself, but they may
+    // have been deleted since the last build. Records are marked used again by
+    // the build that still needs them, the others are dropped when it is saved
+    for (unsigned int i = 0; i < build_db.file_count; i++) {
+        FileRecord *record = &build_db.files[i];
+        if (record->cmd_hash != 0) stat_cache_invalidate(record->path);
+        record->used = false;
+    }
+} // }}}
+
+pid_t watch_start_target(const InternalConfig *conf, int argc, char const *const argv[])
+{ // {{{
+    Cmd cmd = {0};
+    cmd_append_fmt(&cmd, "%s/%s", conf->out_dir, c_config.exe);
+    for (int i = conf->run_argc + 1; i < argc; i++) {
+        cmd_append(&cmd, argv[i]);
+    }
+    pid_t pid;
+    if (!spawn_process(&cmd, NULL, &pid)) {
+        pid = -1;
+    } else {
+        print("INF", "1", "Started %s (pid %d)\n", cmd.argv[0], pid);
+    }
+    cmd_free(&cmd);
+    return pid;
+} // }}}
+void watch_stop_target(pid_t pid)
+{ // {{{
+    // Also reaps a target that already exited on its own
+    if (pid <= 0) return;
+    kill(pid, SIGTERM);
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {}
+} // }}}
+int watch_build(const InternalConfig *conf, const char *lock_file_path, const char *db_file_path,
+        int argc, char const *const argv[])
+{ // {{{
+    // Keeps the build database and stat cache in memory between builds, so a
+    // rebuild only restats the files inotify reported and parses the .d files
+    // of the sources it recompiles
+    Watcher watcher = { .fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK) };
+    if (watcher.fd == -1) {
+        fprintf(stderr, "Error: Failed to start watching: %s\n", strerror(errno));
+        return -1;
+    }
+    pid_t target = -1;
+    int status = 0;
+    for (;;) {
+        double build_start = now_ms();
+        build_state_reset();
+        int built = build_target(conf, db_file_path);
+        release_lock_file(lock_file_path, built >= 0);
+        trace_phase("build", build_start);
+        if (conf->run && built >= 0 && (built > 0 || target == -1)) {
+            watch_stop_target(target);
+            target = watch_start_target(conf, argc, argv);
+        }
+        if (!watch_inputs(&watcher)) {
+            status = -1;
+            break;
+        }
+        print("INF", "1", "Watching %u files for changes\n", watcher.count);
+
+        bool build_file_changed = false;
+        if (watch_wait(&watcher, &build_file_changed) < 0) {
+            status = -1;
+            break;
+        }
+        if (build_file_changed) {
+            // Replaces this process with the rebuilt build, which starts its own target
+            watch_stop_target(target);
+            target = -1;
+            compile_build_file(argv, conf);
+        }
+    }
+    watch_stop_target(target);
+    close(watcher.fd);
+    arena_free(&watcher.names);
+    free(watcher.files);
+    free(watcher.watched);
+    return status;
+} // }}}
+
+// Parse command line arguments
+bool parse_args(struct InternalConfig *conf, int argc, const char *const argv[])
 { // {{{
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--") == 0) {
@@ -579,14 +4626,43 @@ bool parse_args(struct InternalConfig *conf, int argc, const char *const argv[])
         else if (!strcmp(argv[i], "rel")) conf->mode = MODE_REL;
         else if (!strcmp(argv[i], "clean")) conf->clean = true;
         else if (!strcmp(argv[i], "build-only")) conf->build_only = true;
+        else if (!strcmp(argv[i], "no-threading")) conf->thread_count = 0;
+        else if (!strcmp(argv[i], "stats")) conf->stats = true;
+        else if (!strcmp(argv[i], "trace")) conf->trace = true;
+        else if (!strcmp(argv[i], "watch")) conf->watch = true;
+        else if (!strcmp(argv[i], "daemon")) conf->daemon = true;
+        else if (!strcmp(argv[i], "unity")) conf->unity = true;
+        else if (!strcmp(argv[i], "worker")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: Failed to pass the worker address\n");
+                exit(1);
+            }
+            conf->worker = argv[++i];
+        }
         else if (!strcmp(argv[i], "version")) { printf("Build version %s\n", build.ver); return false; }
         else if (!strcmp(argv[i], "help")) { print_help(); return false; }
+        else if (!strcmp(argv[i], "l") || (argv[i][0] == 'l' && isdigit((unsigned char)argv[i][1]))) {
+            const char *load = argv[i][1] != '\0' ? argv[i] + 1 : (i + 1 < argc ? argv[++i] : NULL);
+            if (load == NULL || atof(load) <= 0) {
+                fprintf(stderr, "Error: Failed to pass the maximum load\n");
+                exit(1);
+            }
+            conf->max_load = atof(load);
+        }
+        else if (!strcmp(argv[i], "mem") || (!strncmp(argv[i], "mem", 3) && isdigit((unsigned char)argv[i][3]))) {
+            const char *budget = argv[i][3] != '\0' ? argv[i] + 3 : (i + 1 < argc ? argv[++i] : NULL);
+            if (budget == NULL || atol(budget) <= 0) {
+                fprintf(stderr, "Error: Failed to pass the memory budget\n");
+                exit(1);
+            }
+            conf->mem_budget_mb = atol(budget);
+        }
         else if (argv[i][0] == 'j') {
             int threads = 0;
             if (strlen(argv[i]) > 1) {
                 const char *p = argv[i]+1;
                 threads = atoi(p);
-            } else if (i + 1 <= argc) {
+            } else if (i + 1 < argc) {
                 threads = atoi(argv[++i]);
             } else {
                 fprintf(stderr, "Error: Failed to pass thread count\n");
@@ -604,17 +4680,308 @@ bool parse_args(struct InternalConfig *conf, int argc, const char *const argv[])
     return true;
 } // }}}
 
+// Daemon functions
+static const int DAEMON_IDLE_MS = 15 * 60 * 1000;
+static const int32_t DAEMON_STALE = -2; // Reply of a daemon whose build executable or environment was replaced
+typedef struct DaemonRequest {
+    uint64_t key;        // BUILD_SELF_KEY of the client, the options are only understood by the same executable
+    uint64_t env_hash;   // Environment of the client, which the compilers run by the daemon would see instead
+    InternalConfig conf; // Options the client was started with
+} DaemonRequest;
+
+typedef union DaemonFds {
+    char buffer[CMSG_SPACE(2 * sizeof(int))]; // Control message carrying stdout and stderr
+    struct cmsghdr align;
+} DaemonFds;
+
+typedef struct Daemon {
+    const char *db_file_path; // Build database of the mode the daemon serves
+    struct stat db_stat;      // Build database as last loaded or written by the daemon
+    uint64_t env_hash;        // Environment inherited from the client that started the daemon
+    Watcher watcher;          // Inputs whose stats are kept in the stat cache
+} Daemon;
+
+bool daemon_address(const InternalConfig *conf, struct sockaddr_un *addr)
+{ // {{{
+    // One daemon per mode, next to the build database it keeps in memory
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s.sock", conf->out_dir, build.exe) >= (int)sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: Daemon socket path in %s is too long\n", conf->out_dir);
+        return false;
+    }
+    return true;
+} // }}}
+uint64_t daemon_env_hash()
+{ // {{{
+    // The order of the variables doesn't matter. Left out are the trace
+    // variable, since the trace option is part of the request, and those the
+    // shell rewrites on its own between commands
+    const char *const ignored[] = { TRACE_ENV, "_", "OLDPWD" };
+    uint64_t h = 0;
+    for (char **env = environ; *env != NULL; env++) {
+        bool skip = false;
+        for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]) && !skip; i++) {
+            size_t len = strlen(ignored[i]);
+            skip = strncmp(*env, ignored[i], len) == 0 && (*env)[len] == '=';
+        }
+        if (!skip) h += hash_string(*env, 0);
+    }
+    return h;
+} // }}}
+int daemon_connect(const struct sockaddr_un *addr)
+{ // {{{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+} // }}}
+bool daemon_send_request(int fd, const InternalConfig *conf)
+{ // {{{
+    // The daemon only serves clients started from the same build executable,
+    // so the parsed options are sent as they are. Our stdout and stderr travel
+    // with them so the daemon and the compilers it runs write straight to the
+    // terminal of the client
+    DaemonRequest request = { .key = BUILD_SELF_KEY, .env_hash = daemon_env_hash(), .conf = *conf };
+    const int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    DaemonFds control = {0};
+    struct iovec iov = { .iov_base = &request, .iov_len = sizeof(request) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(request);
+} // }}}
+bool daemon_receive_request(int conn, DaemonRequest *request, int fds[2])
+{ // {{{
+    // fds are -1 when the client didn't send its output
+    fds[0] = fds[1] = -1;
+    DaemonFds control;
+    struct iovec iov = { .iov_base = request, .iov_len = sizeof(*request) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer),
+    };
+    ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    }
+    return got == (ssize_t)sizeof(*request) && fds[0] != -1;
+} // }}}
+bool daemon_file_changed(const char *path, const struct stat *last)
+{ // {{{
+    // Files are replaced by rename, so a new inode or time means a new file
+    struct stat current;
+    if (stat(path, &current) == -1) return last->st_ino != 0;
+    return current.st_ino != last->st_ino
+        || current.st_mtim.tv_sec != last->st_mtim.tv_sec
+        || current.st_mtim.tv_nsec != last->st_mtim.tv_nsec;
+} // }}}
+int32_t daemon_build_request(Daemon *daemon, const InternalConfig *conf)
+{ // {{{
+    // Runs one build exactly like the client would, the in-memory state is
+    // only trusted as far as inotify and the database file allow
+    if (conf->trace) {
+        // The client already started the trace file
+        setenv(TRACE_ENV, "1", 1);
+        if (!trace_init(c_config.dir)) return -1;
+    }
+
+    // Another build without the daemon replaced the database, start over from it
+    if (daemon_file_changed(daemon->db_file_path, &daemon->db_stat)) {
+        double load_start = now_ms();
+        watch_forget(&daemon->watcher);
+        build_db_free(&build_db);
+        stat_cache_clear();
+        deserialize_build_db(daemon->db_file_path, &build_db);
+        trace_phase("load build state", load_start);
+    }
+    bool ignored;
+    watch_read_events(&daemon->watcher, &ignored);
+
+    build_state_reset();
+
+    double build_start = now_ms();
+    int32_t built = build_target(conf, daemon->db_file_path);
+    trace_phase("daemon build", build_start);
+    if (conf->trace) {
+        trace_flush();
+        g_trace.enabled = false;
+    }
+    if (stat(daemon->db_file_path, &daemon->db_stat) == -1) {
+        memset(&daemon->db_stat, 0, sizeof(daemon->db_stat));
+    }
+    if (!watch_inputs(&daemon->watcher)) return -1;
+    return built;
+} // }}}
+int32_t daemon_handle(Daemon *daemon, int conn)
+{ // {{{
+    DaemonRequest request;
+    int fds[2];
+    bool received = daemon_receive_request(conn, &request, fds);
+    int32_t reply = -1;
+    if (received && (request.key != BUILD_SELF_KEY || request.env_hash != daemon->env_hash)) {
+        // The client starts a new daemon that inherits its environment
+        reply = DAEMON_STALE;
+    } else if (received) {
+        // Output goes to the client while the build runs
+        fflush(stdout);
+        fflush(stderr);
+        int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        reply = daemon_build_request(daemon, &request.conf);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+    }
+    if (fds[0] != -1) close(fds[0]);
+    if (fds[1] != -1) close(fds[1]);
+    write_all(conn, &reply, sizeof(reply));
+    return reply;
+} // }}}
+int daemon_serve(int listen_fd, const struct sockaddr_un *addr, const char *db_file_path)
+{ // {{{
+    // Serves builds one at a time until it sits idle for DAEMON_IDLE_MS or a
+    // client built from another build.c or with another environment connects
+    Daemon daemon = { .db_file_path = db_file_path, .env_hash = daemon_env_hash() };
+    daemon.watcher.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (daemon.watcher.fd == -1) {
+        unlink(addr->sun_path);
+        return -1;
+    }
+    // The events the client recorded before the fork are written by the
+    // client, the load below goes to the trace of its first request
+    trace_discard();
+    double load_start = now_ms();
+    deserialize_build_db(db_file_path, &build_db);
+    trace_phase("load build state", load_start);
+    if (stat(db_file_path, &daemon.db_stat) == -1) {
+        memset(&daemon.db_stat, 0, sizeof(daemon.db_stat));
+    }
+    watch_inputs(&daemon.watcher);
+
+    struct pollfd fds[2] = {
+        { .fd = listen_fd, .events = POLLIN },
+        { .fd = daemon.watcher.fd, .events = POLLIN },
+    };
+    for (;;) {
+        int ready = poll(fds, 2, DAEMON_IDLE_MS);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0) break;
+        if (fds[1].revents & POLLIN) {
+            bool ignored;
+            if (watch_read_events(&daemon.watcher, &ignored) < 0) break;
+        }
+        if (!(fds[0].revents & POLLIN)) continue;
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) continue;
+        int32_t reply = daemon_handle(&daemon, conn);
+        close(conn);
+        if (reply == DAEMON_STALE) break;
+    }
+    unlink(addr->sun_path);
+    close(listen_fd);
+    close(daemon.watcher.fd);
+    return 0;
+} // }}}
+int daemon_start(const struct sockaddr_un *addr, const char *db_file_path)
+{ // {{{
+    // The socket is bound before forking so the client can connect right away
+    unlink(addr->sun_path); // Left behind by a daemon that didn't exit cleanly
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1
+            || bind(listen_fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1
+            || listen(listen_fd, 16) == -1) {
+        fprintf(stderr, "Error: Failed to listen on %s: %s\n", addr->sun_path, strerror(errno));
+        if (listen_fd != -1) close(listen_fd);
+        return -1;
+    }
+    print("INF", "1", "Starting build daemon %s\n", addr->sun_path);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error: Failed to start the build daemon: %s\n", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    if (pid == 0) {
+        // Detached from the terminal so the client's Ctrl-C doesn't reach it
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO) close(null_fd);
+        }
+        _exit(daemon_serve(listen_fd, addr, db_file_path) == 0 ? 0 : 1);
+    }
+    close(listen_fd);
+    return daemon_connect(addr);
+} // }}}
+int daemon_build(const InternalConfig *conf, const char *db_file_path)
+{ // {{{
+    // Hands the build to the daemon, starting it when none is listening,
+    // returns the result of build_target() in the daemon
+    struct sockaddr_un addr;
+    if (!daemon_address(conf, &addr)) return -1;
+    fflush(stdout);
+    fflush(stderr);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = daemon_connect(&addr);
+        if (fd == -1) fd = daemon_start(&addr, db_file_path);
+        if (fd == -1) return -1;
+        int32_t reply;
+        bool ok = daemon_send_request(fd, conf)
+            && read_all(fd, &reply, sizeof(reply));
+        close(fd);
+        if (!ok) {
+            fprintf(stderr, "Error: Lost the connection to the build daemon\n");
+            return -1;
+        }
+        if (reply != DAEMON_STALE) return reply;
+        // The daemon was started from another build executable or environment and exits
+    }
+    fprintf(stderr, "Error: The build daemon could not be restarted\n");
+    return -1;
+} // }}}
+
 int main(int argc, const char *const argv[])
 { // {{{
+    double build_start = now_ms();
     struct InternalConfig conf = {0};
-    conf.thread_count = MAX_CPU_CORES;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    conf.thread_count = cores > 0 ? (int)cores : 1;
     if (!parse_args(&conf, argc, argv)) {
         return 0;
     }
+    if (conf.worker != NULL) {
+        return remote_serve(conf.worker, conf.thread_count);
+    }
 
     if (conf.clean) {
         // Clean the build directory
-        if (exec("rm -rf %s", c_config.dir) != 0) {
+        Cmd cmd = {0};
+        cmd_append(&cmd, "rm");
+        cmd_append(&cmd, "-rf");
+        cmd_append(&cmd, c_config.dir);
+        int status = exec(&cmd);
+        cmd_free(&cmd);
+        if (status != 0) {
             fprintf(stderr, "Error: Failed to clean the build directory %s\n", c_config.dir);
             return -1;
         }
@@ -622,15 +4989,30 @@ int main(int argc, const char *const argv[])
         return 0; // Exit after cleaning
     }
 
-    // Create the build directory if it doesn't exist
-    recursive_mkdir(c_config.dir);
+    // Create the build directory of the mode if it doesn't exist
+    if (snprintf(conf.out_dir, sizeof(conf.out_dir), "%s/%s", c_config.dir, mode_dir_name(conf.mode)) >= (int)sizeof(conf.out_dir)) {
+        fprintf(stderr, "Error: Output directory %s is too long\n", c_config.dir);
+        return -1;
+    }
+    recursive_mkdir(conf.out_dir);
+    if (conf.trace && !trace_init(c_config.dir)) {
+        return -1;
+    }
 
     // Get the lock file path and deserialize the lock file
     char lock_file_path[PATH_MAX];
     snprintf(lock_file_path, PATH_MAX, "%s/%s.lock", c_config.dir, build.exe);
+    double lock_start = now_ms();
     if (!deserialize_lock_file(lock_file_path, &lockfile)) {
         serialize_lock_file(lock_file_path, &lockfile);
     }
+    trace_phase("load lock file", lock_start);
+
+    char db_file_path[PATH_MAX];
+    if (snprintf(db_file_path, PATH_MAX, "%s/%s.db", conf.out_dir, build.exe) >= PATH_MAX) {
+        fprintf(stderr, "Error: Build database path in %s is too long\n", conf.out_dir);
+        return -1;
+    }
 
     // Check if the build is locked
     if (lockfile.lock) {
@@ -642,57 +5024,68 @@ int main(int argc, const char *const argv[])
     lockfile.lock = true;
 
     // Build the build file if it has changed
-    int ret = compile_build_file(lock_file_path, argc, argv, &conf);
+    int ret = compile_build_file(argv, &conf);
     if (ret != 0) {
-        lockfile.last_mode = conf.mode;
-        lockfile.lock = false;
-        lockfile.rebuilding = false;
-        serialize_lock_file(lock_file_path, &lockfile);
+        release_lock_file(lock_file_path, false);
         return ret;
     }
 
     // If only building the build file, exit after building
     if (conf.build_only) {
         print("INF", "1", "Build only mode\n");
-        lockfile.last_mode = conf.mode;
-        lockfile.lock = false;
-        lockfile.rebuilding = false;
-        serialize_lock_file(lock_file_path, &lockfile);
+        release_lock_file(lock_file_path, false);
         return 0;
     }
 
-    // Compile the source files if they have changed
-    int files_built = compile_files(&c_config, &conf);
+    // Share one thread count with a parent make, the daemon couldn't take
+    // tokens for this build so it builds here instead
+    if (jobserver_connect()) {
+        print("INF", "1", "Using the jobserver from MAKEFLAGS\n");
+        conf.daemon = false;
+    } else if (conf.run && conf.watch && conf.thread_count > 0) {
+        // The target runs alongside the rebuilds and shares the tokens
+        jobserver_serve(conf.out_dir, conf.thread_count - 1);
+    }
 
-    // Run the build command to create the executable
-    if (files_built != 0) {
-        if (!compile_exe(&c_config)) {
-            fprintf(stderr, "Error: Failed to compile the executable\n");
-            lockfile.last_mode = conf.mode;
-            lockfile.lock = false;
-            lockfile.rebuilding = false;
-            serialize_lock_file(lock_file_path, &lockfile);
-            return -1;
-        }
+    // Compile the source files if they have changed and link the executable,
+    // the daemon keeps the build database loaded between builds
+    int built;
+    if (conf.daemon && !conf.watch) {
+        built = daemon_build(&conf, db_file_path);
     } else {
-        print("INF", "1", "No files were changed\n");
+        // Load the fingerprints of the files used by the last build in this mode
+        double load_start = now_ms();
+        deserialize_build_db(db_file_path, &build_db);
+        trace_phase("load build state", load_start);
+        if (conf.watch) {
+            return watch_build(&conf, lock_file_path, db_file_path, argc, argv);
+        }
+        built = build_target(&conf, db_file_path);
     }
 
     // Update the lock file after the build is complete and release the lock
-    lockfile.last_build = time(NULL);
-    lockfile.lock = false;
-    lockfile.last_mode = conf.mode;
-    lockfile.rebuilding = false; // Reset rebuilding state after a successful build
-
-    // Serialize the lock file to save the state
-    serialize_lock_file(lock_file_path, &lockfile);
+    release_lock_file(lock_file_path, built >= 0);
+    if (built < 0) {
+        return -1;
+    }
+    if (conf.stats) {
+        print("STAT", "35", "Total: %.3f ms\n", now_ms() - build_start);
+    }
+    trace_phase("build", build_start);
+    trace_flush(); // Write the trace before handing over to the target
 
     if (conf.run) {
-        char cmd[PATH_MAX];
-        snprintf(cmd, PATH_MAX, "%s/%s", c_config.dir, c_config.exe);
+        // Nested builds and makes started by the target share its thread count
+        if (g_jobserver.read_fd == -1 && conf.thread_count > 0) {
+            jobserver_serve(conf.out_dir, conf.thread_count - 1);
+        }
+        Cmd cmd = {0};
+        cmd_append_fmt(&cmd, "%s/%s", conf.out_dir, c_config.exe);
         for (int i = conf.run_argc + 1; i < argc; i++)
-            snprintf(cmd + strlen(cmd), PATH_MAX - strlen(cmd), " %s", argv[i]);
-        return exec(cmd);
+            cmd_append(&cmd, argv[i]);
+        int status = exec(&cmd);
+        cmd_free(&cmd);
+        return status;
     }
 
     return 0;
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#define PATH_MAX 4096
+
+// Benchmark of the build executable on a generated project.
+//
+//   gcc -O2 -o bench_build bench_build.c && ./bench_build [OPTIONS] > bench.json
+//
+// The project is written to `dir`, built with a copy of ../build.c and every
+// scenario is timed `runs` times. Results are printed as JSON on stdout, the
+// progress on stderr.
+
+typedef struct {
+    unsigned int sources;  // Number of translation units
+    unsigned int headers;  // Number of headers besides common.h
+    unsigned int fanout;   // Headers included by every source and header
+    unsigned int depth;    // Levels of headers including each other
+    unsigned int cpp;      // Percentage of the sources written in C++
+    unsigned int runs;     // Timed runs of every scenario
+    unsigned int jobs;     // Passed to the build as `j NUM`, 0 keeps the default
+    const char *dir;       // Directory the project is generated into
+    const char *build_c;   // The build.c that is benchmarked
+    const char *cc;        // C compiler of the project and of build.c
+    const char *cxx;       // C++ compiler of the project
+    const char *out;       // File the JSON is written to, NULL for stdout
+    bool keep;             // Keep the project directory afterwards
+} BenchConfig;
+
+typedef struct {
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    long max_rss_kb;
+    long minor_faults;
+    long major_faults;
+    long voluntary_switches;
+    long involuntary_switches;
+    long block_in;
+    long block_out;
+    int exit_code;
+} BenchResult;
+
+typedef struct {
+    const char *name;
+    const char *setup;  // Untimed shell command run in the project before each run
+    const char *edit;   // File a line is appended to before each run, relative to the project
+    const char *args;   // Arguments of the timed ./build
+} Scenario;
+
+static BenchConfig g_bench = {
+    .sources = 100,
+    .headers = 50,
+    .fanout = 4,
+    .depth = 3,
+    .cpp = 20,
+    .runs = 3,
+    .jobs = 0,
+    .dir = "./bench_project",
+    .build_c = "../build.c",
+    .cc = "gcc",
+    .cxx = "g++",
+    .out = NULL,
+    .keep = false,
+};
+
+// Editing a file appends a comment instead of touching it, the build compares
+// content hashes and would treat an updated modification time as a no-op.
+static const Scenario g_scenarios[] = {
+    { "cold_full",          "rm -rf out", NULL,                "" },
+    { "noop",               NULL,         NULL,                "" },
+    { "edit_leaf_source",   NULL,         "src/src_0.c",       "" },
+    { "edit_common_header", NULL,         "include/common.h",  "" },
+    { "mode_switch",        "./build",    NULL,                "rel" },
+    { "self_rebuild",       NULL,         "build.c",           "" },
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+static double timeval_ms(struct timeval tv) {
+    return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
+}
+
+// --- Project generation ---
+static bool source_is_cpp(unsigned int i) {
+    return i != 0 && (i % 100) < g_bench.cpp;
+}
+static unsigned int level_size(unsigned int level) {
+    unsigned int per_level = g_bench.headers / g_bench.depth;
+    if (level == g_bench.depth - 1) return g_bench.headers - per_level * (g_bench.depth - 1);
+    return per_level;
+}
+static unsigned int level_start(unsigned int level) {
+    return level * (g_bench.headers / g_bench.depth);
+}
+// Writes the `#include` lines of the `fanout` headers a file at `level` pulls
+// in from the next level, spread over that level by the file's index.
+static void write_includes(FILE *fp, unsigned int level, unsigned int index) {
+    if (level >= g_bench.depth) return;
+    unsigned int size = level_size(level);
+    if (size == 0) return;
+    unsigned int count = g_bench.fanout < size ? g_bench.fanout : size;
+    for (unsigned int f = 0; f < count; f++) {
+        unsigned int h = level_start(level) + (index * g_bench.fanout + f) % size;
+        fprintf(fp, "#include \"hdr_%u.h\"\n", h);
+    }
+}
+int write_header(unsigned int h, unsigned int level) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/include/hdr_%u.h", g_bench.dir, h);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "#ifndef HDR_%u_H\n#define HDR_%u_H\n#include \"common.h\"\n", h, h);
+    write_includes(fp, level + 1, h);
+    fprintf(fp, "typedef struct { int values[%u]; bench_value total; } hdr_%u_state;\n", 4 + h % 8, h);
+    for (unsigned int k = 0; k < 4; k++) {
+        fprintf(fp,
+            "static inline bench_value hdr_%u_fn_%u(bench_value x) {\n"
+            "    for (int i = 0; i < %u; i++) x = x * %uu + (x >> %u);\n"
+            "    return x ^ %uu;\n"
+            "}\n", h, k, 2 + k, 31 + h + k, 1 + k, h * 7 + k);
+    }
+    fprintf(fp, "#endif\n");
+    fclose(fp);
+    return 0;
+}
+int write_source(unsigned int i) {
+    char path[PATH_MAX];
+    bool cpp = source_is_cpp(i);
+    snprintf(path, sizeof(path), "%s/src/src_%u.%s", g_bench.dir, i, cpp ? "cpp" : "c");
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "#include \"common.h\"\n");
+    write_includes(fp, 0, i);
+    if (cpp) {
+        fprintf(fp,
+            "template <typename T, int N>\n"
+            "static T src_%u_fold(T x) {\n"
+            "    for (int i = 0; i < N; i++) x = x * 33 + (T)i;\n"
+            "    return x;\n"
+            "}\n", i);
+    }
+    for (unsigned int k = 0; k < 20; k++) {
+        fprintf(fp,
+            "%sbench_value src_%u_fn_%u(bench_value x) {\n"
+            "    bench_value acc = x;\n"
+            "    for (int i = 0; i < %u; i++) {\n"
+            "        acc = acc * %uu + (bench_value)i;\n"
+            "        if (acc & 1) acc ^= x >> %u;\n"
+            "    }\n", cpp ? "extern \"C\" " : "", i, k, 8 + k, 17 + k, 1 + k % 7);
+        if (cpp) fprintf(fp, "    acc = src_%u_fold<bench_value, %u>(acc);\n", i, 2 + k % 5);
+        fprintf(fp, "    return acc;\n}\n");
+    }
+    if (i == 0) {
+        fprintf(fp, "int main(void) {\n    return (int)(src_0_fn_0(1) & 1);\n}\n");
+    }
+    fclose(fp);
+    return 0;
+}
+// Copies build.c into the project with `src[]`, `cc` and `build.cc` pointing at
+// the generated sources and the requested compilers.
+int write_build_c(void) {
+    FILE *in = fopen(g_bench.build_c, "r");
+    if (!in) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", g_bench.build_c, strerror(errno));
+        return -1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/build.c", g_bench.dir);
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Failed to create %s: %s\n", path, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+    char line[4096];
+    bool in_src = false;
+    bool replaced_src = false;
+    while (fgets(line, sizeof(line), in)) {
+        if (in_src) {
+            if (strstr(line, "},")) in_src = false;
+            continue;
+        }
+        if (!replaced_src && strstr(line, ".src = (const char *[]) {")) {
+            fputs(line, out);
+            for (unsigned int i = 0; i < g_bench.sources; i++) {
+                fprintf(out, "        \"./src/src_%u.%s\",\n", i, source_is_cpp(i) ? "cpp" : "c");
+            }
+            fprintf(out, "        NULL, // Sentinel to mark the end of the array\n    },\n");
+            in_src = true;
+            replaced_src = true;
+            continue;
+        }
+        if (strstr(line, ".cc = (Compilers){")) {
+            fprintf(out, "    .cc = (Compilers){ .c = \"%s\", .cpp = \"%s\" },\n", g_bench.cc, g_bench.cxx);
+            continue;
+        }
+        if (strstr(line, ".incs = (const char *[]) {")) {
+            fputs(line, out);
+            fprintf(out, "        \"-I./include\",\n");
+            continue;
+        }
+        char *build = strstr(line, "} build = { \"");
+        if (build) {
+            char *rest = strchr(build + strlen("} build = { \""), '"');
+            fprintf(out, "} build = { \"%s%s", g_bench.cc, rest ? rest : "\", \"./build.c\", \"./build\", \"\" };\n");
+            continue;
+        }
+        fputs(line, out);
+    }
+    fclose(in);
+    fclose(out);
+    if (!replaced_src) {
+        fprintf(stderr, "Error: No src[] list found in %s\n", g_bench.build_c);
+        return -1;
+    }
+    return 0;
+}
+int generate_project(void) {
+    char path[PATH_MAX];
+    const char *dirs[] = { "", "/src", "/include" };
+    for (unsigned int i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", g_bench.dir, dirs[i]);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Failed to create %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/include/common.h", g_bench.dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "#ifndef COMMON_H\n#define COMMON_H\n#include <stdint.h>\ntypedef uint64_t bench_value;\n#endif\n");
+    fclose(fp);
+    for (unsigned int level = 0; level < g_bench.depth; level++) {
+        for (unsigned int k = 0; k < level_size(level); k++) {
+            if (write_header(level_start(level) + k, level) != 0) return -1;
+        }
+    }
+    for (unsigned int i = 0; i < g_bench.sources; i++) {
+        if (write_source(i) != 0) return -1;
+    }
+    return write_build_c();
+}
+
+// --- Running the build ---
+int append_line(const char *file) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", g_bench.dir, file);
+    FILE *fp = fopen(path, "a");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    static unsigned int edit_count = 0;
+    fprintf(fp, "// bench edit %u\n", ++edit_count);
+    fclose(fp);
+    return 0;
+}
+int run_shell(const char *cmd) {
+    char buf[PATH_MAX + 512];
+    snprintf(buf, sizeof(buf), "cd '%s' && %s > /dev/null", g_bench.dir, cmd);
+    int status = system(buf);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: '%s' failed with status %d\n", cmd, status);
+        return -1;
+    }
+    return 0;
+}
+// Runs ./build with `args` in the project and measures it with wait4. The usage
+// covers the build and every compiler and linker it waited for.
+int run_build(const char *args, BenchResult *result) {
+    char cmd[512];
+    if (g_bench.jobs > 0) {
+        snprintf(cmd, sizeof(cmd), "./build %s j %u", args, g_bench.jobs);
+    } else {
+        snprintf(cmd, sizeof(cmd), "./build %s", args);
+    }
+    char *argv[32];
+    int argc = 0;
+    for (char *tok = strtok(cmd, " "); tok && argc < 31; tok = strtok(NULL, " ")) {
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (chdir(g_bench.dir) != 0 || null_fd < 0) _exit(127);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        fprintf(stderr, "Error: wait4 failed: %s\n", strerror(errno));
+        return -1;
+    }
+    result->wall_ms = now_ms() - start;
+    result->user_ms = timeval_ms(usage.ru_utime);
+    result->sys_ms = timeval_ms(usage.ru_stime);
+    result->max_rss_kb = usage.ru_maxrss;
+    result->minor_faults = usage.ru_minflt;
+    result->major_faults = usage.ru_majflt;
+    result->voluntary_switches = usage.ru_nvcsw;
+    result->involuntary_switches = usage.ru_nivcsw;
+    result->block_in = usage.ru_inblock;
+    result->block_out = usage.ru_oublock;
+    result->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return 0;
+}
+int bootstrap(void) {
+    char cmd[PATH_MAX];
+    snprintf(cmd, sizeof(cmd), "%s -o build build.c -lpthread && ./build build-only", g_bench.cc);
+    return run_shell(cmd);
+}
+
+// --- Output ---
+void print_result(FILE *fp, const BenchResult *r, bool last) {
+    fprintf(fp,
+        "        { \"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, \"max_rss_kb\": %ld, "
+        "\"minor_faults\": %ld, \"major_faults\": %ld, \"voluntary_switches\": %ld, "
+        "\"involuntary_switches\": %ld, \"block_in\": %ld, \"block_out\": %ld, \"exit_code\": %d }%s\n",
+        r->wall_ms, r->user_ms, r->sys_ms, r->max_rss_kb, r->minor_faults, r->major_faults,
+        r->voluntary_switches, r->involuntary_switches, r->block_in, r->block_out, r->exit_code,
+        last ? "" : ",");
+}
+int run_scenarios(FILE *fp) {
+    unsigned int count = sizeof(g_scenarios) / sizeof(g_scenarios[0]);
+    BenchResult *results = calloc(g_bench.runs, sizeof(BenchResult));
+    if (!results) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"project\": { \"sources\": %u, \"headers\": %u, \"fanout\": %u, \"depth\": %u, "
+        "\"cpp_percent\": %u, \"runs\": %u, \"jobs\": %u, \"cc\": \"%s\", \"cxx\": \"%s\" },\n",
+        g_bench.sources, g_bench.headers, g_bench.fanout, g_bench.depth, g_bench.cpp,
+        g_bench.runs, g_bench.jobs, g_bench.cc, g_bench.cxx);
+    fprintf(fp, "  \"scenarios\": [\n");
+    for (unsigned int s = 0; s < count; s++) {
+        const Scenario *scenario = &g_scenarios[s];
+        // The first mode switch also compiles the build executable for the
+        // other mode, which is not what this scenario measures.
+        if (!strcmp(scenario->args, "rel") && run_shell("./build rel") != 0) goto fail;
+        double min_wall = 0;
+        for (unsigned int r = 0; r < g_bench.runs; r++) {
+            if (scenario->setup && run_shell(scenario->setup) != 0) goto fail;
+            if (scenario->edit && append_line(scenario->edit) != 0) goto fail;
+            if (run_build(scenario->args, &results[r]) != 0) goto fail;
+            if (r == 0 || results[r].wall_ms < min_wall) min_wall = results[r].wall_ms;
+            fprintf(stderr, "%-20s run %u: %.1f ms (exit %d)\n",
+                scenario->name, r + 1, results[r].wall_ms, results[r].exit_code);
+        }
+        // Leave the default mode built for the next scenario
+        if (!strcmp(scenario->args, "rel") && run_shell("./build") != 0) goto fail;
+        fprintf(fp, "    { \"name\": \"%s\", \"min_wall_ms\": %.3f, \"runs\": [\n", scenario->name, min_wall);
+        for (unsigned int r = 0; r < g_bench.runs; r++) {
+            print_result(fp, &results[r], r + 1 == g_bench.runs);
+        }
+        fprintf(fp, "    ] }%s\n", s + 1 == count ? "" : ",");
+    }
+    fprintf(fp, "  ]\n}\n");
+    free(results);
+    return 0;
+fail:
+    free(results);
+    return -1;
+}
+
+// --- Arguments ---
+bool parse_uint(const char *arg, unsigned int *value) {
+    if (!arg) return false;
+    char *end = NULL;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') return false;
+    *value = (unsigned int)v;
+    return true;
+}
+void print_usage(void) {
+    printf(
+        "Usage: ./bench_build [OPTIONS]\n"
+        "    sources NUM    Number of source files (default: %u)\n"
+        "    headers NUM    Number of headers (default: %u)\n"
+        "    fanout NUM     Headers included by every source and header (default: %u)\n"
+        "    depth NUM      Levels of nested headers (default: %u)\n"
+        "    cpp NUM        Percentage of C++ sources (default: %u)\n"
+        "    runs NUM       Timed runs of every scenario (default: %u)\n"
+        "    j NUM          Worker threads passed to the build\n"
+        "    dir PATH       Directory of the generated project (default: %s)\n"
+        "    build PATH     build.c to benchmark (default: %s)\n"
+        "    cc CC          C compiler (default: %s)\n"
+        "    cxx CXX        C++ compiler (default: %s)\n"
+        "    out FILE       Write the JSON to FILE instead of stdout\n"
+        "    keep           Keep the generated project\n",
+        g_bench.sources, g_bench.headers, g_bench.fanout, g_bench.depth, g_bench.cpp,
+        g_bench.runs, g_bench.dir, g_bench.build_c, g_bench.cc, g_bench.cxx);
+}
+int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = true;
+        if (!strcmp(argv[i], "sources")) ok = parse_uint(value, &g_bench.sources), i++;
+        else if (!strcmp(argv[i], "headers")) ok = parse_uint(value, &g_bench.headers), i++;
+        else if (!strcmp(argv[i], "fanout")) ok = parse_uint(value, &g_bench.fanout), i++;
+        else if (!strcmp(argv[i], "depth")) ok = parse_uint(value, &g_bench.depth), i++;
+        else if (!strcmp(argv[i], "cpp")) ok = parse_uint(value, &g_bench.cpp), i++;
+        else if (!strcmp(argv[i], "runs")) ok = parse_uint(value, &g_bench.runs), i++;
+        else if (!strcmp(argv[i], "j")) ok = parse_uint(value, &g_bench.jobs), i++;
+        else if (!strcmp(argv[i], "dir")) ok = value != NULL, g_bench.dir = value, i++;
+        else if (!strcmp(argv[i], "build")) ok = value != NULL, g_bench.build_c = value, i++;
+        else if (!strcmp(argv[i], "cc")) ok = value != NULL, g_bench.cc = value, i++;
+        else if (!strcmp(argv[i], "cxx")) ok = value != NULL, g_bench.cxx = value, i++;
+        else if (!strcmp(argv[i], "out")) ok = value != NULL, g_bench.out = value, i++;
+        else if (!strcmp(argv[i], "keep")) g_bench.keep = true;
+        else if (!strcmp(argv[i], "help")) { print_usage(); exit(0); }
+        else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return -1;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: Missing or invalid value for %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+    if (g_bench.sources == 0 || g_bench.depth == 0 || g_bench.runs == 0 || g_bench.cpp > 100) {
+        fprintf(stderr, "Error: sources, depth and runs must be at least 1 and cpp at most 100\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) != 0) {
+        print_usage();
+        return 1;
+    }
+    char cmd[PATH_MAX];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", g_bench.dir);
+    system(cmd);
+    fprintf(stderr, "Generating %u sources and %u headers in %s\n", g_bench.sources, g_bench.headers, g_bench.dir);
+    if (generate_project() != 0 || bootstrap() != 0) return 1;
+
+    FILE *fp = stdout;
+    if (g_bench.out) {
+        fp = fopen(g_bench.out, "w");
+        if (!fp) {
+            fprintf(stderr, "Error: Failed to create %s: %s\n", g_bench.out, strerror(errno));
+            return 1;
+        }
+    }
+    int result = run_scenarios(fp);
+    if (fp != stdout) fclose(fp);
+    if (!g_bench.keep) system(cmd);
+    return result == 0 ? 0 : 1;
+}
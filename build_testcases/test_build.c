@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #define PATH_MAX 4096
@@ -11,6 +13,7 @@ void strip_extension(const char *src, char *dst, size_t dst_size);
 void get_filename_without_path(const char *src, char *dst, size_t dst_size);
 void get_path_without_filename(const char *src, char *dst, size_t dst_size);
 unsigned int get_array_length(const char *const *array);
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
 
 // --- Utility function implementations (copied from build.c for testing) ---
 void strip_extension(const char *src, char *dst, size_t dst_size) {
@@ -44,6 +47,71 @@ unsigned int get_array_length(const char *const *array) {
     return length;
 }
 
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static inline uint64_t xxh64_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t xxh64_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline uint32_t xxh64_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *const end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        const uint8_t *const limit = end - 32;
+        do {
+            v1 = xxh64_round(v1, xxh64_read64(p)); p += 8;
+            v2 = xxh64_round(v2, xxh64_read64(p)); p += 8;
+            v3 = xxh64_round(v3, xxh64_read64(p)); p += 8;
+            v4 = xxh64_round(v4, xxh64_read64(p)); p += 8;
+        } while (p <= limit);
+        h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) + xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+        h = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
 // --- Test cases ---
 void test_strip_extension() {
     char dst[PATH_MAX];
@@ -99,6 +167,20 @@ void test_get_array_length() {
     assert(len2 == 0);
     printf("%-40s [\033[32mPASSED\033[0m]\n", "test_get_array_length");
 }
+void test_hash_bytes() {
+    printf("\033[1m%-40s\033[0m\n", "Running test_hash_bytes");
+    const char *long_input = "Nobody inspects the spammish repetition";
+    uint64_t h1 = hash_bytes("", 0, 0);
+    uint64_t h2 = hash_bytes("abc", 3, 0);
+    uint64_t h3 = hash_bytes(long_input, strlen(long_input), 0);
+    printf("hash_bytes('') -> %016llx (expected ef46db3751d8e999)\n", (unsigned long long)h1);
+    assert(h1 == 0xEF46DB3751D8E999ULL);
+    printf("hash_bytes('abc') -> %016llx (expected 44bc2cf5ad770999)\n", (unsigned long long)h2);
+    assert(h2 == 0x44BC2CF5AD770999ULL);
+    printf("hash_bytes(long_input) -> %016llx (expected fbcea83c8a378bf1)\n", (unsigned long long)h3);
+    assert(h3 == 0xFBCEA83C8A378BF1ULL);
+    printf("%-40s [\033[32mPASSED\033[0m]\n", "test_hash_bytes");
+}
 
 
 // Helper to run a system command and print the command and exit status
@@ -108,6 +190,123 @@ int run_and_log(const char *cmd) {
     return status;
 }
 
+// Helper to stop the tests with a message, unlike assert it also works under NDEBUG
+void fail(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "\033[31mFAILED\033[0m ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+// Helper to write a file of the test project, creating its directory first
+void write_file(const char *path, const char *content) {
+    char dir[PATH_MAX], cmd[PATH_MAX + 16];
+    get_path_without_filename(path, dir, sizeof(dir));
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s", dir);
+    if (system(cmd) != 0) fail("mkdir -p %s", dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) fail("fopen(%s)", path);
+    fputs(content, fp);
+    fclose(fp);
+}
+
+#define MAX_EDITS 6
+#define MAX_FILES 8
+#define MAX_CHECKS 6
+#define MAX_STEPS 6
+
+// Helper to write test_project/build.c, a copy of ../build.c with every
+// edits[i][0] replaced by edits[i][1] up to a NULL edits[i][0]
+void write_build_c(const char *const edits[MAX_EDITS][2]) {
+    FILE *fp = fopen("../build.c", "r");
+    if (!fp) fail("fopen(../build.c)");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = malloc(size + 1);
+    if (!text || fread(text, 1, size, fp) != (size_t)size) fail("read ../build.c");
+    text[size] = '\0';
+    fclose(fp);
+    for (int i = 0; i < MAX_EDITS && edits[i][0] != NULL; i++) {
+        // An edit that no longer matches would test the unchanged config
+        char *at = strstr(text, edits[i][0]);
+        if (!at) fail("build.c doesn't contain the text to replace:\n%s", edits[i][0]);
+        size_t from_len = strlen(edits[i][0]), to_len = strlen(edits[i][1]);
+        char *patched = malloc(strlen(text) - from_len + to_len + 1);
+        if (!patched) fail("malloc");
+        sprintf(patched, "%.*s%s%s", (int)(at - text), text, edits[i][1], at + from_len);
+        free(text);
+        text = patched;
+    }
+    write_file("test_project/build.c", text);
+    free(text);
+}
+
+// One command run in the test project and the checks of its output
+typedef struct Step {
+    const char *edits[MAX_EDITS][2]; // Replacements in ../build.c, build.c is only rewritten when there are some
+    const char *files[MAX_FILES][2]; // Project files written before the command, path and contents
+    const char *command;             // Shell command run in test_project/ that has to succeed, NULL ends the steps
+    const char *expect[MAX_CHECKS];  // Strings the output contains
+    const char *reject[MAX_CHECKS];  // Strings the output doesn't contain
+    const char *order[MAX_CHECKS];   // Strings the output contains in this order
+} Step;
+typedef struct Scenario {
+    const char *name;
+    Step steps[MAX_STEPS];
+} Scenario;
+
+// Helper to run the steps of a scenario in a fresh test_project/, the first
+// step always writes build.c and compiles it
+void run_scenario(const Scenario *scenario) {
+    char title[128];
+    snprintf(title, sizeof(title), "Running %s", scenario->name);
+    printf("\033[1m%-40s\033[0m\n", title);
+    run_and_log("rm -rf test_project");
+    static char out[1 << 16];
+    for (int s = 0; s < MAX_STEPS && scenario->steps[s].command != NULL; s++) {
+        const Step *step = &scenario->steps[s];
+        if (s == 0 || step->edits[0][0] != NULL) write_build_c(step->edits);
+        if (s == 0 && run_and_log("cd test_project && gcc -o build build.c -lpthread") != 0) {
+            fail("%s: build.c doesn't compile", scenario->name);
+        }
+        for (int f = 0; f < MAX_FILES && step->files[f][0] != NULL; f++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "test_project/%s", step->files[f][0]);
+            write_file(path, step->files[f][1]);
+        }
+        char cmd[4096];
+        snprintf(cmd, sizeof(cmd), "cd test_project && (%s) > ../build_output.txt 2>&1", step->command);
+        int status = run_and_log(cmd);
+        FILE *fp = fopen("build_output.txt", "r");
+        if (!fp) fail("fopen(build_output.txt)");
+        size_t len = fread(out, 1, sizeof(out) - 1, fp);
+        out[len] = '\0';
+        fclose(fp);
+        printf("%s", out);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fail("%s step %d: '%s' exited with status %d", scenario->name, s + 1, step->command, status);
+        }
+        const char *from = out;
+        for (int c = 0; c < MAX_CHECKS; c++) {
+            if (step->expect[c] != NULL && !strstr(out, step->expect[c])) {
+                fail("%s step %d: output lacks '%s'", scenario->name, s + 1, step->expect[c]);
+            }
+            if (step->reject[c] != NULL && strstr(out, step->reject[c])) {
+                fail("%s step %d: output has '%s'", scenario->name, s + 1, step->reject[c]);
+            }
+            if (step->order[c] != NULL && !(from = strstr(from, step->order[c]))) {
+                fail("%s step %d: '%s' is missing or out of order", scenario->name, s + 1, step->order[c]);
+            }
+        }
+    }
+    run_and_log("rm -rf test_project build_output.txt");
+    printf("%-40s [\033[32mPASSED\033[0m]\n", scenario->name);
+}
+
 
 // --- Test running build executable as a subprocess ---
 void test_run_build_help() {
@@ -147,22 +346,298 @@ void test_run_build_on_main() {
     assert(WIFEXITED(status));
     status = run_and_log("cd ./build_testcases");
     // Check if output executable exists
-    FILE *fp = fopen("../out/example_app", "r");
+    FILE *fp = fopen("../out/default/example_app", "r");
     if (!fp) {
-        perror("fopen(../out/example_app)");
+        perror("fopen(../out/default/example_app)");
     }
     assert(fp);
     fclose(fp);
     printf("%-40s [\033[32mPASSED\033[0m]\n", "test_run_build_on_main");
 }
 
+// Parts of the default config that the scenarios replace
+#define SRC_MAIN "        \"./src/main.c\",\n"
+#define SRC_ALL "        \"./src/*.c\",\n"
+#define EXCLUDE "    .exclude = (const char *[]) {\n"
+#define FLAGS_WALL "        \"-Wall\",\n"
+#define LINK "    .link = (const char *[]) {\n"
+#define TARGETS_END "        { .name = NULL },"
+#define PCH_NONE "    .pch = (Pch){ .c = NULL, .cpp = NULL },\n"
+#define CACHE_NONE "    .cache = (Cache){ .dir = NULL, .max_size = 1024 },\n"
+#define CACHE_LOCAL "    .cache = (Cache){ .dir = \"./cache\", .max_size = 1024 },\n"
+// Ends the daemons started in the test project
+#define KILL_DAEMON "for p in $(pgrep -f '^\\./build daemon'); do [ \"$(readlink /proc/$p/cwd)\" = \"$PWD\" ] && kill $p; done; true"
+#define CACHE_1MB "    .cache = (Cache){ .dir = \"./cache\", .max_size = 1 },\n"
+#define CC_SH "\"./cc.sh\", .cpp"
+// Compiler that records in counts.log how many compiles run at once
+#define CC_SH_COUNTING "#!/bin/sh\ncase \" $* \" in *\" -c \"*)\n" \
+    "    mkdir -p running; touch running/$$; ls running | wc -l >> counts.log\n" \
+    "    sleep 0.3; rm running/$$;;\nesac\nexec gcc \"$@\"\n"
+#define MAX_COUNT "max=$(sort -n counts.log | tail -1)"
+#define X16(s) s s s s s s s s s s s s s s s s
+// A define of 160KB, longer than the kernel takes as a single argument
+#define BIG_FLAG "        \"-DBIG=" X16(X16(X16("xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"))) "\",\n"
+// Compiler that notes a response file and leaves out BIG, which gcc couldn't hand on to cc1
+#define CC_SH_RESPONSE "#!/bin/sh\ncase \"$1\" in @*)\n" \
+    "    grep -q '^-DBIG=' \"${1#@}\" && echo \"response file\" >> rsp.log\n" \
+    "    set -- $(grep -v '^-DBIG=' \"${1#@}\");;\nesac\nexec gcc \"$@\"\n"
+#define WORKERS "    .workers = (const char *[]) {\n"
+
+#define MAIN_WITH_HEADER "#include \"main.h\"\nint main(void) { return VALUE; }\n"
+#define MAIN_CALLS_UTIL "int util(void);\nint main(void) { return util(); }\n"
+#define LIBUTIL_A_EDITS \
+    { LINK, LINK "        \"libutil.a\",\n" }, \
+    { TARGETS_END, "        { .name = \"libutil.a\", .kind = TARGET_STATIC, .src = (const char *[]){ \"./lib/util.c\", NULL } },\n" TARGETS_END }
+
+static const Scenario scenarios[] = {
+    { "test_touch_does_not_rebuild", {
+        { .files = { { "src/main.c", MAIN_WITH_HEADER }, { "src/main.h", "#define VALUE 0\n" } },
+          .command = "./build", .expect = { "./src/main.c" } },
+        // Only the timestamps change, so nothing is compiled or linked
+        { .command = "touch src/main.c src/main.h && ./build",
+          .expect = { "No files were changed" }, .reject = { "./src/main.c" } },
+    } },
+    { "test_flag_change_rebuilds_affected", {
+        { .edits = { LIBUTIL_A_EDITS },
+          .files = { { "src/main.c", MAIN_CALLS_UTIL }, { "lib/util.c", "int util(void) { return 0; }\n" } },
+          .command = "./build", .expect = { "./src/main.c", "./lib/util.c" } },
+        // A changed flag of every source recompiles all of them
+        { .edits = { LIBUTIL_A_EDITS, { FLAGS_WALL, FLAGS_WALL "        \"-DEXTRA\",\n" } },
+          .command = "./build", .expect = { "./src/main.c", "./lib/util.c" } },
+        // A shared library compiles its sources with -fPIC, which leaves main.c alone
+        { .edits = {
+              { LINK, LINK "        \"libutil.so\",\n" },
+              { TARGETS_END, "        { .name = \"libutil.so\", .kind = TARGET_SHARED, .src = (const char *[]){ \"./lib/util.c\", NULL } },\n" TARGETS_END },
+              { FLAGS_WALL, FLAGS_WALL "        \"-DEXTRA\",\n" } },
+          .command = "./build && out/default/example_app",
+          .expect = { "./lib/util.c" }, .reject = { "./src/main.c" } },
+    } },
+    { "test_recursive_glob", {
+        { .edits = { { SRC_MAIN, "        \"./src/**/*.c\",\n" }, { EXCLUDE, EXCLUDE "        \"./src/third_party/**\",\n" } },
+          .files = {
+              { "src/main.c", "int one(void);\nint two(void);\nint main(void) { return one() + two(); }\n" },
+              { "src/a/one.c", "int one(void) { return 0; }\n" },
+              { "src/a/b/two.c", "int two(void) { return 0; }\n" },
+              // Neither compiles, so the build fails if the patterns pick them up
+              { "src/third_party/excluded.c", "#error excluded\n" },
+              { "src/.hidden/hidden.c", "#error hidden\n" } },
+          .command = "./build && out/default/example_app",
+          .expect = { "./src/main.c", "./src/a/one.c", "./src/a/b/two.c" } },
+        // A source added to a directory seen before is found on the next build
+        { .files = { { "src/a/b/three.c", "int three(void) { return 0; }\n" } },
+          .command = "./build", .expect = { "./src/a/b/three.c" }, .reject = { "./src/a/b/two.c" } },
+    } },
+    { "test_early_cutoff_skips_link", {
+        { .files = { { "src/main.c", MAIN_WITH_HEADER }, { "src/main.h", "#define VALUE 0\n" } },
+          .command = "./build" },
+        // A comment recompiles main.c into the same object, so the link is skipped
+        { .files = { { "src/main.h", "#define VALUE 0\n// Only a comment\n" } },
+          .command = "./build",
+          .expect = { "./src/main.c", "Early cutoff: 1 of 1 recompiled objects are unchanged",
+                      "example_app (unchanged)", "Skipped linking" },
+          .reject = { "Linking took" } },
+        // A change to the code still relinks
+        { .files = { { "src/main.h", "#define VALUE 3\n// Only a comment\n" } },
+          .command = "./build && { out/default/example_app; echo \"exit $?\"; }",
+          .expect = { "exit 3" }, .reject = { "Early cutoff", "example_app (unchanged)" } },
+    } },
+    { "test_mixed_targets", {
+        { .edits = {
+              { LINK, LINK "        \"libutil.so\",\n" },
+              { TARGETS_END,
+                "        { .name = \"libcore.a\", .kind = TARGET_STATIC, .src = (const char *[]){ \"./core/*.c\", NULL } },\n"
+                "        { .name = \"libutil.so\", .kind = TARGET_SHARED, .src = (const char *[]){ \"./util/*.c\", NULL },\n"
+                "          .link = (const char *[]){ \"libcore.a\", NULL } },\n"
+                "        { .name = \"tool\", .kind = TARGET_EXECUTABLE, .src = (const char *[]){ \"./tool/*.c\", NULL },\n"
+                "          .link = (const char *[]){ \"libcore.a\", NULL } },\n" TARGETS_END } },
+          .files = {
+              { "core/core.c", "int core(void) { return 2; }\n" },
+              { "util/util.c", "int core(void);\nint util(void) { return core() + 1; }\n" },
+              { "tool/tool.c", "int core(void);\nint main(void) { return core(); }\n" },
+              { "src/main.c", MAIN_CALLS_UTIL } },
+          .command = "./build",
+          // Every library is linked before its users in the same run
+          .expect = { "] tool" }, .order = { "] libcore.a", "] libutil.so", "] example_app" } },
+        // The shared library is found next to the executables from any directory
+        { .command = "cd / && { \"$OLDPWD\"/out/default/example_app; echo \"app $?\"; \"$OLDPWD\"/out/default/tool; echo \"tool $?\"; }",
+          .expect = { "app 3", "tool 2" } },
+    } },
+    { "test_linker_probe", {
+        // ld.bogus is on PATH but gcc doesn't know -fuse-ld=bogus, so the next linker is used
+        { .edits = { { "        \"mold\",\n        \"lld\",\n", "        \"bogus\",\n        \"gold\",\n" } },
+          .files = { { "src/main.c", "int main(void) { return 0; }\n" }, { "bin/ld.bogus", "#!/bin/sh\nexit 1\n" } },
+          .command = "chmod +x bin/ld.bogus && PATH=\"$PWD/bin:$PATH\" ./build && out/default/example_app",
+          .expect = { "doesn't accept -fuse-ld=bogus", "with gold" } },
+    } },
+    { "test_failed_pch_skips_sources", {
+        // The sources wait for the PCH and are skipped when it fails, not compiled without it
+        { .edits = { { SRC_MAIN, SRC_ALL }, { PCH_NONE, "    .pch = (Pch){ .c = (const char *[]){ \"./src/pch.h\", NULL }, .cpp = NULL },\n" } },
+          .files = { { "src/pch.h", "#error broken header\n" },
+                     { "src/main.c", "int a(void);\nint main(void) { return a(); }\n" },
+                     { "src/a.c", "int a(void) { return 0; }\n" } },
+          .command = "./build; echo \"exit $?\"",
+          .expect = { "broken header", "./src/main.c (skipped)", "./src/a.c (skipped)", "1 of 3 source files failed", "exit 255" } },
+        // Once the header is fixed the skipped sources are compiled
+        { .files = { { "src/pch.h", "#include <stdio.h>\n" } },
+          .command = "./build && out/default/example_app",
+          .expect = { "pch_c.h", "./src/main.c", "./src/a.c" }, .reject = { "(skipped)" } },
+    } },
+    { "test_object_cache", {
+        // Objects of about 600KB, two of them don't fit in a 1MB cache
+        { .edits = { { SRC_MAIN, SRC_ALL }, { CACHE_NONE, CACHE_1MB } },
+          .files = { { "src/main.c", "int main(void) { return 0; }\n" },
+                     { "src/a.c", "char big_a[600000] = {1};\n" } },
+          .command = "./build", .expect = { "Cache: 0 hits, 2 misses" }, .reject = { "Evicted" } },
+        // The cache outlives the output directory
+        { .command = "./build clean && ./build",
+          .expect = { "./src/main.c (cached)", "./src/a.c (cached)", "Cache: 2 hits, 0 misses" } },
+        // The entries used longest ago are evicted first
+        { .files = { { "src/b.c", "char big_b[600000] = {1};\n" } },
+          .command = "find cache -type f -exec touch -d '1 hour ago' {} + && ./build",
+          .expect = { "Cache: 0 hits, 1 misses", "Evicted" } },
+        { .command = "./build clean && ./build",
+          .expect = { "./src/b.c (cached)" }, .reject = { "./src/a.c (cached)" } },
+        // Other flags, here -fPIC, are another key
+        { .edits = { { SRC_MAIN, SRC_ALL }, { CACHE_NONE, CACHE_1MB }, { FLAGS_WALL, FLAGS_WALL "        \"-fPIC\",\n" } },
+          .command = "./build", .expect = { "Cache: 0 hits, 3 misses" }, .reject = { "(cached)" } },
+    } },
+    { "test_load_and_memory_limits", {
+        // Without a history the compiles aren't expected to need memory, and j8 runs them together
+        { .edits = { { SRC_MAIN, SRC_ALL }, { "\"gcc\", .cpp", CC_SH } },
+          .files = { { "cc.sh", CC_SH_COUNTING }, { "src/main.c", "int main(void) { return 0; }\n" },
+                     { "src/a.c", "int a;\n" }, { "src/b.c", "int b;\n" }, { "src/c.c", "int c;\n" } },
+          .command = "chmod +x cc.sh && ./build j8 && " MAX_COUNT " && [ \"$max\" -ge 2 ] && echo \"$max compiles at once\"",
+          .expect = { "compiles at once" }, .reject = { "Waited" } },
+        // The recorded peaks don't fit two at a time in 1MB
+        { .command = "rm -rf out/default/src counts.log && ./build j8 mem 1"
+                     " && " MAX_COUNT " && [ \"$max\" -eq 1 ] && echo \"one compile at a time\"",
+          .expect = { "Waited", "one compile at a time" } },
+        // A busy loop keeps the load at 1 or more while the build runs
+        { .command = "timeout 60 sh -c 'while :; do :; done' & busy=$!;"
+                     " rm -rf out/default/src counts.log && ./build j8 l 0.5 && " MAX_COUNT "; kill $busy;"
+                     " [ \"$max\" -eq 1 ] && echo \"one compile at a time\"",
+          .expect = { "Waited", "one compile at a time" } },
+        { .command = "./build mem 0; echo \"exit $?\"", .expect = { "Failed to pass the memory budget", "exit 1" } },
+    } },
+    { "test_jobserver_limits_compiles", {
+        // j8 asks for more jobs than make -j3 allows, cc.sh records how many
+        // compiles run at once
+        { .edits = { { SRC_MAIN, SRC_ALL }, { "\"gcc\", .cpp", CC_SH } },
+          .files = { { "Makefile", "all:\n\t+./build j8\n" }, { "cc.sh", CC_SH_COUNTING },
+                     { "src/main.c", "int main(void) { return 0; }\n" },
+                     { "src/a.c", "int a;\n" }, { "src/b.c", "int b;\n" }, { "src/c.c", "int c;\n" },
+                     { "src/d.c", "int d;\n" }, { "src/e.c", "int e;\n" } },
+          .command = "chmod +x cc.sh && ./build build-only && make -j3"
+                     " && " MAX_COUNT " && [ \"$max\" -ge 2 ] && [ \"$max\" -le 3 ]"
+                     " && echo \"at most $max compiles\"",
+          .expect = { "Using the jobserver from MAKEFLAGS", "at most" } },
+    } },
+    { "test_jobserver_serves_target", {
+        // The target finds the fifo in MAKEFLAGS holding a token for each job beyond its own
+        { .files = { { "src/main.c",
+                "#include <fcntl.h>\n#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <unistd.h>\n"
+                "int main(void) {\n"
+                "    const char *flags = getenv(\"MAKEFLAGS\");\n"
+                "    const char *fifo = flags != NULL ? strstr(flags, \"fifo:\") : NULL;\n"
+                "    if (fifo == NULL) { puts(\"no jobserver\"); return 0; }\n"
+                "    char tokens[16];\n"
+                "    int fd = open(fifo + 5, O_RDONLY | O_NONBLOCK);\n"
+                "    printf(\"MAKEFLAGS=%s\\n%d tokens\\n\", flags, (int)read(fd, tokens, sizeof(tokens)));\n"
+                "    return 0;\n}\n" } },
+          .command = "./build j3 -- && { ls out/default | grep -q jobserver || echo \"fifo removed\"; }",
+          .expect = { "-j3 --jobserver-auth=fifo:", "2 tokens", "fifo removed" }, .reject = { "no jobserver" } },
+        // Under make the target shares the tokens of make instead of a fifo of its own
+        { .files = { { "Makefile", "all:\n\t+./build j3 --\n" } },
+          .command = "make -j2", .expect = { "Using the jobserver from MAKEFLAGS" }, .reject = { "fifo:" } },
+    } },
+    { "test_unity_batches", {
+        // With batches of two on average, seven sources give a single batch of several sources
+        { .edits = { { SRC_MAIN, SRC_ALL }, { "(Unity){ .files = 8,", "(Unity){ .files = 2," } },
+          .files = { { "src/main.c", "int main(void) { return 0; }\n" },
+                     { "src/a.c", "int a;\n" }, { "src/b.c", "int b;\n" }, { "src/c.c", "int c;\n" },
+                     { "src/d.c", "int d;\n" }, { "src/e.c", "int e;\n" }, { "src/f.c", "int f;\n" } },
+          .command = "./build unity && ls out/default/unity/src > batches.txt && sed 's/^unity_[0-9a-f]*/batch/' batches.txt"
+                     " && { find out/default -name 'unity_*' ! -path 'out/default/unity/*' | grep -q . || echo \"next to the batch\"; }",
+          .expect = { "Unity: 7 sources", "batch.c", "batch.d", "batch.o", "next to the batch" } },
+        // Removing two of its sources regroups the batch, the old one goes with its object
+        { .command = "rm src/c.c src/d.c && ./build unity && ls out/default/unity/src > now.txt"
+                     " && { comm -12 batches.txt now.txt | grep -q . || echo \"stale batch removed\"; }",
+          .expect = { "Unity: 5 sources", "stale batch removed" } },
+    } },
+    { "test_archives_and_response_files", {
+        // Static libraries hold copies of their objects unless thin archives are asked for
+        { .edits = { LIBUTIL_A_EDITS },
+          .files = { { "src/main.c", MAIN_CALLS_UTIL }, { "lib/util.c", "int util(void) { return 0; }\n" } },
+          .command = "./build && head -c 7 out/default/libutil.a", .expect = { "!<arch>" } },
+        { .edits = { LIBUTIL_A_EDITS, { ".thin_archives = false,", ".thin_archives = true," } },
+          .command = "./build && out/default/example_app && head -c 7 out/default/libutil.a", .expect = { "!<thin>" } },
+        // Compiles with an argument too long for the kernel get a response file, removed afterwards
+        { .edits = { LIBUTIL_A_EDITS, { FLAGS_WALL, FLAGS_WALL BIG_FLAG }, { "\"gcc\", .cpp", CC_SH } },
+          .files = { { "cc.sh", CC_SH_RESPONSE } },
+          .command = "chmod +x cc.sh && mkdir tmp && TMPDIR=$PWD/tmp ./build && out/default/example_app && cat rsp.log"
+                     " && { ls tmp | grep -q . || echo \"response files removed\"; }",
+          .expect = { "response file", "response files removed" } },
+    } },
+    { "test_daemon_cache_counters", {
+        { .edits = { { SRC_MAIN, SRC_ALL }, { CACHE_NONE, CACHE_LOCAL } },
+          .files = { { "src/main.c", "int a(void);\nint main(void) { return a(); }\n" },
+                     { "src/a.c", "int a(void) { return 0; }\n" } },
+          .command = "./build daemon", .expect = { "Starting build daemon", "Cache: 0 hits, 2 misses" } },
+        // The same daemon counts only the hits of this build
+        { .command = "rm -rf out/default/src && ./build daemon",
+          .expect = { "Cache: 2 hits, 0 misses" }, .reject = { "Starting build daemon" } },
+        { .command = "rm out/default/src/a.o && ./build daemon",
+          .expect = { "Cache: 1 hits, 0 misses" } },
+        { .command = KILL_DAEMON },
+    } },
+    { "test_trace_stays_in_build", {
+        // The rebuilt build executable appends to the trace, the compilers and
+        // the program run after -- don't see the variable that tells it to
+        { .edits = { { "\"gcc\", .cpp", CC_SH } },
+          .files = { { "src/main.c", "#include <stdio.h>\n#include <stdlib.h>\n"
+                       "int main(void) { puts(getenv(\"BUILD_TRACE_APPEND\") ? \"program traced\" : \"program clean\"); return 0; }\n" },
+                     { "cc.sh", "#!/bin/sh\n[ -n \"$BUILD_TRACE_APPEND\" ] && echo compiler traced\nexec gcc \"$@\"\n" } },
+          .command = "chmod +x cc.sh && ./build trace -- && cat out/trace.json",
+          .expect = { "program clean", "\"self-rebuild\"", "\"load lock file\"", "\"load build state\"" },
+          .reject = { "compiler traced", "program traced" } },
+        // The daemon forked by the client traces its own load of the build database
+        { .command = "./build trace daemon && cat out/trace.json",
+          .expect = { "\"load lock file\"", "\"load build state\"", "\"daemon build\"" } },
+        { .command = KILL_DAEMON },
+    } },
+    { "test_remote_worker_refusal", {
+        // The worker runs until killed, timeout ends it should a step fail
+        { .edits = { { SRC_MAIN, SRC_ALL }, { WORKERS, WORKERS "        \"unix:worker.sock\",\n" } },
+          .files = { { "src/main.c", "int a(void);\nint main(void) { return a(); }\n" },
+                     { "src/a.c", "int a(void) { return 0; }\n" } },
+          .command = "timeout 60 ./build worker unix:worker.sock > worker.log 2>&1 & echo $! > worker.pid;"
+                     " while [ ! -S worker.sock ]; do sleep 0.05; done; ./build && cat worker.log",
+          .expect = { "Workers: 2 compiled remotely, 0 compiled here", "gcc in" } },
+        // -fstack-usage writes a file next to the object, so the worker refuses it
+        // and the sources are compiled here
+        { .edits = { { SRC_MAIN, SRC_ALL }, { WORKERS, WORKERS "        \"unix:worker.sock\",\n" },
+                     { FLAGS_WALL, FLAGS_WALL "        \"-fstack-usage\",\n" } },
+          .command = "./build && cat worker.log && ls out/default/src",
+          .expect = { "refused -fstack-usage", "Workers: 0 compiled remotely, 1 compiled here", "main.su", "a.su" } },
+        { .command = "kill $(cat worker.pid)" },
+    } },
+};
+
+void test_build_scenarios() {
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run_scenario(&scenarios[i]);
+    }
+}
+
 int main() {
     test_strip_extension();
     test_get_filename_without_path();
     test_get_path_without_filename();
     test_get_array_length();
+    test_hash_bytes();
     test_run_build_help();
     test_run_build_on_main();
+    test_build_scenarios();
     printf("%-40s [\033[32mALL PASSED\033[0m]\n", "All tests");
     return 0;
 }